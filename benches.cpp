@@ -0,0 +1,977 @@
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <memory_resource>
+#include <new>
+#include <shared_mutex>
+#include <span>
+#include <sstream>
+#include <string>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
+
+#include "benchmark/benchmark.h"
+
+#include "socow-atomic-vector.h"
+#include "socow-chunked-vector.h"
+#include "socow-overlay-vector.h"
+#include "socow-pool-allocator.h"
+#include "socow-vector.h"
+
+namespace {
+
+// same layout as uint64_t, but not trivially copyable
+struct nontrivial_u64 {
+    nontrivial_u64(uint64_t val = 0) : val(val) {}
+
+    nontrivial_u64(nontrivial_u64 const& rhs) : val(rhs.val) {}
+
+    nontrivial_u64& operator=(nontrivial_u64 const& rhs) {
+        val = rhs.val;
+        return *this;
+    }
+
+    ~nontrivial_u64() {}
+
+    uint64_t val;
+};
+
+template <typename T>
+socow_vector<T, 4> make_filled(size_t n) {
+    socow_vector<T, 4> v;
+    v.reserve(n);
+    for (size_t i = 0; i != n; ++i)
+        v.push_back(T(i));
+    return v;
+}
+
+template <typename T>
+void BM_detach(benchmark::State& state) {
+    size_t const n = state.range(0);
+    socow_vector<T, 4> a = make_filled<T>(n);
+    for (auto _ : state) {
+        socow_vector<T, 4> b = a;
+        benchmark::DoNotOptimize(b.data());
+    }
+    state.SetBytesProcessed(state.iterations() * n * sizeof(T));
+}
+
+template <typename T>
+void BM_growth(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        socow_vector<T, 4> v;
+        for (size_t i = 0; i != n; ++i)
+            v.push_back(T(i));
+        benchmark::DoNotOptimize(v.data());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename T>
+void BM_erase_front(benchmark::State& state) {
+    size_t const n = state.range(0);
+    socow_vector<T, 4> v = make_filled<T>(n);
+    for (auto _ : state) {
+        v.erase(v.begin());
+        v.push_back(T(0));
+        benchmark::ClobberMemory();
+    }
+    state.SetBytesProcessed(state.iterations() * n * sizeof(T));
+}
+
+template <typename RefCount>
+socow_vector<uint64_t, 4, RefCount> make_shared_source() {
+    socow_vector<uint64_t, 4, RefCount> a;
+    for (size_t i = 0; i != 64; ++i)
+        a.push_back(i);
+    return a;
+}
+
+template <typename RefCount>
+void BM_share(benchmark::State& state) {
+    socow_vector<uint64_t, 4, RefCount> a = make_shared_source<RefCount>();
+    for (auto _ : state) {
+        socow_vector<uint64_t, 4, RefCount> b = a;
+        benchmark::DoNotOptimize(b);
+    }
+}
+
+// copies of one storage made and dropped from several threads at once
+template <typename RefCount>
+void BM_share_threads(benchmark::State& state) {
+    static socow_vector<uint64_t, 4, RefCount> const a =
+        make_shared_source<RefCount>();
+    for (auto _ : state) {
+        socow_vector<uint64_t, 4, RefCount> b = a;
+        benchmark::DoNotOptimize(b);
+    }
+}
+
+// a table published to worker threads as a frozen snapshot
+void BM_frozen_share_threads(benchmark::State& state) {
+    static auto const table =
+        make_shared_source<socow::nonatomic_refcount>().freeze();
+    for (auto _ : state) {
+        auto snapshot = table;
+        benchmark::DoNotOptimize(snapshot);
+    }
+}
+
+// a routing table read by many threads, published through
+// atomic_socow_vector or guarded by a shared_mutex
+void BM_publish_atomic(benchmark::State& state) {
+    static atomic_socow_vector<uint64_t, 4> table(
+        make_shared_source<socow::atomic_refcount>());
+    for (auto _ : state) {
+        auto snapshot = table.load();
+        benchmark::DoNotOptimize(snapshot[17]);
+    }
+}
+
+void BM_publish_shared_mutex(benchmark::State& state) {
+    static std::shared_mutex mutex;
+    static socow_vector<uint64_t, 4> const table =
+        make_shared_source<socow::nonatomic_refcount>();
+    for (auto _ : state) {
+        std::shared_lock lock(mutex);
+        benchmark::DoNotOptimize(table[17]);
+    }
+}
+
+#if defined(SOCOW_HAS_POSIX)
+// a lookup array loaded at startup, read element by element or mapped
+std::filesystem::path write_lookup_file(size_t n) {
+    std::filesystem::path path =
+        std::filesystem::temp_directory_path() / "socow-bench-lookup";
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    for (uint64_t i = 0; i != n; ++i)
+        out.write(reinterpret_cast<char const*>(&i), sizeof(i));
+    return path;
+}
+
+void BM_load_file_push_back(benchmark::State& state) {
+    auto path = write_lookup_file(state.range(0));
+    for (auto _ : state) {
+        std::ifstream in(path, std::ios::binary);
+        socow_vector<uint64_t, 4> v;
+        uint64_t x;
+        while (in.read(reinterpret_cast<char*>(&x), sizeof(x)))
+            v.push_back(x);
+        benchmark::DoNotOptimize(v.cdata());
+    }
+    std::filesystem::remove(path);
+}
+
+void BM_load_file_mapped(benchmark::State& state) {
+    auto path = write_lookup_file(state.range(0));
+    for (auto _ : state) {
+        auto v = socow_vector<uint64_t, 4>::map_file(path.c_str());
+        benchmark::DoNotOptimize(v.cdata());
+    }
+    std::filesystem::remove(path);
+}
+#endif
+
+// a received buffer turned back into a vector, one element at a time or
+// with read_from()
+std::string serialized_lookup(size_t n) {
+    socow_vector<uint64_t, 4> v;
+    for (size_t i = 0; i != n; ++i)
+        v.push_back(i);
+    std::ostringstream out;
+    v.write_to(out);
+    return out.str();
+}
+
+void BM_deserialize_elementwise(benchmark::State& state) {
+    std::string bytes = serialized_lookup(state.range(0));
+    for (auto _ : state) {
+        std::istringstream in(bytes);
+        in.ignore(sizeof(socow::binary_header));
+        socow_vector<uint64_t, 4> v;
+        uint64_t x;
+        while (in.read(reinterpret_cast<char*>(&x), sizeof(x)))
+            v.push_back(x);
+        benchmark::DoNotOptimize(v.cdata());
+    }
+}
+
+void BM_deserialize_bulk(benchmark::State& state) {
+    std::string bytes = serialized_lookup(state.range(0));
+    for (auto _ : state) {
+        std::istringstream in(bytes);
+        auto v = socow_vector<uint64_t, 4>::read_from(in);
+        benchmark::DoNotOptimize(v.cdata());
+    }
+}
+
+// detach latency of a million strings, copied by state.range(0) threads
+struct detach_string {
+    std::string value;
+};
+
+unsigned detach_copy_threads = 1;
+
+} // namespace
+
+template <>
+struct socow::parallel_copy<detach_string> {
+    static constexpr size_t threshold = 1 << 12;
+
+    static unsigned threads() {
+        return detach_copy_threads;
+    }
+};
+
+namespace {
+
+void BM_parallel_detach(benchmark::State& state) {
+    detach_copy_threads = state.range(0);
+    socow_vector<detach_string, 1> a;
+    for (size_t i = 0; i != 1 << 20; ++i)
+        a.push_back({std::string(32, char('a' + i % 26))});
+    for (auto _ : state) {
+        auto b = a;
+        b.detach();
+        benchmark::DoNotOptimize(b.cdata());
+        state.PauseTiming();
+        b = {};
+        state.ResumeTiming();
+    }
+}
+
+// medium vectors created, copied, detached and dropped, from malloc or from
+// the thread's block_pool; allocs/op counts the blocks that came from the
+// system allocator
+template <typename Vector>
+void run_medium_vectors(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        Vector a;
+        for (size_t i = 0; i != n; ++i)
+            a.push_back(i);
+        Vector b = a;
+        b[0] = 1;
+        benchmark::DoNotOptimize(b.data());
+    }
+}
+
+void BM_medium_vectors_malloc(benchmark::State& state) {
+    using vector = socow_vector<uint64_t, 4, socow::nonatomic_refcount,
+                                std::allocator<uint64_t>, socow::growth_2x,
+                                alignof(uint64_t), socow::thread_stats>;
+    socow::thread_stats::reset();
+    run_medium_vectors<vector>(state);
+    auto stats = socow::thread_stats::snapshot();
+    state.counters["allocs/op"] = benchmark::Counter(
+        double(stats[socow::stat::allocations] +
+               stats[socow::stat::reallocations]),
+        benchmark::Counter::kAvgIterations);
+}
+
+void BM_medium_vectors_pool(benchmark::State& state) {
+    socow::block_pool::reset_stats();
+    run_medium_vectors<socow::pooled_vector<uint64_t, 4>>(state);
+    state.counters["allocs/op"] =
+        benchmark::Counter(double(socow::block_pool::stats().misses),
+                           benchmark::Counter::kAvgIterations);
+}
+
+// a receive buffer of n bytes made ready for read()
+void BM_buffer_push_back(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        socow_vector<char, 16> buffer;
+        for (size_t i = 0; i != n; ++i)
+            buffer.push_back(0);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+}
+
+void BM_buffer_resize(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        socow_vector<char, 16> buffer;
+        buffer.resize(n);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+}
+
+void BM_buffer_resize_for_overwrite(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        socow_vector<char, 16> buffer;
+        buffer.resize_for_overwrite(n);
+        benchmark::DoNotOptimize(buffer.data());
+    }
+}
+
+// copies and scans of short vectors with a hand-picked SMALL_SIZE and with
+// the default one, which fills a cache line
+template <typename Vector>
+void report_layout(benchmark::State& state) {
+    state.counters["sizeof"] = sizeof(Vector);
+    state.counters["inline"] = Vector().capacity();
+}
+
+template <typename Vector>
+void BM_small_size_copy(benchmark::State& state) {
+    Vector a;
+    for (int i = 0; i != state.range(0); ++i)
+        a.push_back(i);
+    for (auto _ : state) {
+        Vector b = a;
+        benchmark::DoNotOptimize(b);
+    }
+    report_layout<Vector>(state);
+}
+
+template <typename Vector>
+void BM_small_size_iterate(benchmark::State& state) {
+    std::vector<Vector> vectors(1 << 12);
+    for (Vector& v : vectors) {
+        for (int i = 0; i != state.range(0); ++i)
+            v.push_back(i);
+    }
+    for (auto _ : state) {
+        int sum = 0;
+        for (Vector const& v : vectors) {
+            for (int x : v)
+                sum += x;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * vectors.size());
+    report_layout<Vector>(state);
+}
+
+// a short-lived vector per "request", from the global heap or from an arena
+void BM_request_scoped_heap(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        socow_vector<uint64_t, 4> v;
+        for (size_t i = 0; i != n; ++i)
+            v.push_back(i);
+        benchmark::DoNotOptimize(v.data());
+    }
+}
+
+void BM_request_scoped_arena(benchmark::State& state) {
+    size_t const n = state.range(0);
+    std::pmr::monotonic_buffer_resource arena(n * sizeof(uint64_t) * 4);
+    for (auto _ : state) {
+        {
+            socow::pmr::vector<uint64_t, 4> v(&arena);
+            for (size_t i = 0; i != n; ++i)
+                v.push_back(i);
+            benchmark::DoNotOptimize(v.data());
+        }
+        arena.release();
+    }
+}
+
+template <typename T>
+T make_value(size_t i) {
+    return T(i);
+}
+
+// long enough to live on the heap
+template <>
+std::string make_value<std::string>(size_t i) {
+    return std::string(32, static_cast<char>('a' + i % 26));
+}
+
+template <typename Vector>
+Vector make_sequence(size_t n) {
+    using value_type = std::decay_t<decltype(*std::declval<Vector>().begin())>;
+    Vector v;
+    v.reserve(n + 1);
+    for (size_t i = 0; i != n; ++i)
+        v.push_back(make_value<value_type>(i));
+    return v;
+}
+
+template <typename Vector>
+void BM_insert_middle(benchmark::State& state) {
+    size_t const n = state.range(0);
+    Vector v = make_sequence<Vector>(n);
+    for (auto _ : state) {
+        v.insert(v.begin() + n / 2, v.back());
+        v.erase(v.begin() + n / 2);
+    }
+}
+
+template <typename Vector>
+void BM_insert_range_middle(benchmark::State& state) {
+    size_t const n = state.range(0);
+    Vector src = make_sequence<Vector>(n / 4);
+    for (auto _ : state) {
+        state.PauseTiming();
+        Vector v = make_sequence<Vector>(n);
+        state.ResumeTiming();
+        v.insert(v.begin() + n / 2, src.begin(), src.end());
+        benchmark::DoNotOptimize(v.data());
+    }
+}
+
+template <typename Vector>
+void BM_erase_range(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        state.PauseTiming();
+        Vector v = make_sequence<Vector>(n);
+        state.ResumeTiming();
+        v.erase(v.begin() + n / 4, v.end() - n / 4);
+        benchmark::DoNotOptimize(v.data());
+    }
+}
+
+// edits of a shared vector: fused into the detach or after a full detach
+template <typename T, bool Fused>
+void BM_shared_erase(benchmark::State& state) {
+    size_t const n = state.range(0);
+    socow_vector<T, 4> a = make_sequence<socow_vector<T, 4>>(n);
+    for (auto _ : state) {
+        socow_vector<T, 4> b = a;
+        if constexpr (!Fused)
+            benchmark::DoNotOptimize(b.data());
+        b.erase(std::as_const(b).begin() + n / 4, std::as_const(b).end() - n / 4);
+        benchmark::DoNotOptimize(b);
+    }
+}
+
+template <typename T, bool Fused>
+void BM_shared_pop_back(benchmark::State& state) {
+    size_t const n = state.range(0);
+    socow_vector<T, 4> a = make_sequence<socow_vector<T, 4>>(n);
+    for (auto _ : state) {
+        socow_vector<T, 4> b = a;
+        if constexpr (!Fused)
+            benchmark::DoNotOptimize(b.data());
+        b.pop_back();
+        benchmark::DoNotOptimize(b);
+    }
+}
+
+template <typename Growth>
+using growth_vector =
+    socow_vector<uint64_t, 4, socow::nonatomic_refcount,
+                 std::allocator<uint64_t>, Growth>;
+
+template <typename Growth>
+void BM_growth_policy(benchmark::State& state) {
+    size_t const n = state.range(0);
+    size_t capacity = 0;
+    for (auto _ : state) {
+        growth_vector<Growth> v;
+        for (size_t i = 0; i != n; ++i)
+            v.push_back(i);
+        benchmark::DoNotOptimize(v.data());
+        capacity = v.capacity();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+    state.counters["slack"] = double(capacity - n) / n;
+}
+
+#if defined(__linux__)
+long proc_status_kb(char const* field) {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    size_t len = std::strlen(field);
+    while (std::getline(status, line)) {
+        if (line.compare(0, len, field) == 0)
+            return std::atol(line.c_str() + len + 1);
+    }
+    return 0;
+}
+
+// growth of the peak resident set while one vector is filled; the peak is
+// reset through /proc/self/clear_refs first
+template <typename Growth>
+void BM_growth_policy_peak_rss(benchmark::State& state) {
+    size_t const n = state.range(0);
+    long peak = 0;
+    for (auto _ : state) {
+#if defined(__GLIBC__)
+        malloc_trim(0);
+#endif
+        std::ofstream("/proc/self/clear_refs") << "5";
+        long before = proc_status_kb("VmRSS");
+        {
+            growth_vector<Growth> v;
+            for (size_t i = 0; i != n; ++i)
+                v.push_back(i);
+            benchmark::DoNotOptimize(v.data());
+        }
+        peak = proc_status_kb("VmHWM") - before;
+    }
+    state.counters["peak_rss_kb"] = peak;
+}
+#endif
+
+// malloc-backed like the default allocator, but not std::allocator, so the
+// vector grows by allocate-and-copy instead of realloc
+template <typename T>
+struct malloc_allocator {
+    using value_type = T;
+
+    malloc_allocator() = default;
+
+    template <typename U>
+    malloc_allocator(malloc_allocator<U> const&) {}
+
+    T* allocate(size_t n) {
+        if (void* p = std::malloc(n * sizeof(T)))
+            return static_cast<T*>(p);
+        throw std::bad_alloc();
+    }
+
+    void deallocate(T* p, size_t) {
+        std::free(p);
+    }
+
+    friend bool operator==(malloc_allocator, malloc_allocator) {
+        return true;
+    }
+
+    friend bool operator!=(malloc_allocator, malloc_allocator) {
+        return false;
+    }
+};
+
+using realloc_vector = socow_vector<uint64_t, 4>;
+using copy_vector = socow_vector<uint64_t, 4, socow::nonatomic_refcount,
+                                 malloc_allocator<uint64_t>>;
+
+template <typename Vector>
+void BM_append(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        Vector v;
+        for (size_t i = 0; i != n; ++i)
+            v.push_back(i);
+        benchmark::DoNotOptimize(v.data());
+    }
+    state.SetBytesProcessed(state.iterations() * n * sizeof(uint64_t));
+}
+
+// append-only buffer that grows in fixed 1 MiB steps, the worst case for
+// reallocation by copy
+template <typename Vector>
+void BM_reserve_steps(benchmark::State& state) {
+    size_t const n = state.range(0);
+    size_t const step = (1 << 20) / sizeof(uint64_t);
+    for (auto _ : state) {
+        Vector v;
+        while (v.size() < n) {
+            v.reserve(v.size() + step);
+            for (size_t i = 0; i != step; ++i)
+                v.push_back(i);
+        }
+        benchmark::DoNotOptimize(v.data());
+    }
+    state.SetBytesProcessed(state.iterations() * n * sizeof(uint64_t));
+}
+
+using nested_vector = socow_vector<socow_vector<size_t, 2>, 2>;
+
+// the shape of performance.insert: an outer vector of small inner vectors,
+// shifted as a whole by an insert at the front, so sizeof the inner vector
+// is what gets moved around
+void BM_nested_insert(benchmark::State& state) {
+    size_t const n = state.range(0);
+    nested_vector a;
+    for (size_t i = 0; i != n; ++i) {
+        a.push_back({});
+        a.back().push_back(i);
+    }
+    socow_vector<size_t, 2> inner;
+    inner.push_back(0);
+    for (auto _ : state) {
+        a.insert(a.begin(), inner);
+        a.erase(a.begin());
+        benchmark::ClobberMemory();
+    }
+    state.counters["sizeof_inner"] = sizeof(socow_vector<size_t, 2>);
+    state.SetBytesProcessed(state.iterations() * n *
+                            sizeof(socow_vector<size_t, 2>));
+}
+
+void BM_nested_fill(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        nested_vector a;
+        for (size_t i = 0; i != n; ++i) {
+            a.push_back({});
+            a.back().push_back(i);
+            a.back().push_back(i);
+        }
+        benchmark::DoNotOptimize(a.data());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// Per-element writes through operator[], which checks for sharing on every
+// call, against writes through a span taken once.
+template <typename Vector>
+void BM_write_indexed(benchmark::State& state) {
+    size_t const n = state.range(0);
+    Vector v = make_sequence<Vector>(n);
+    for (auto _ : state) {
+        for (size_t i = 0; i != n; ++i)
+            v[i] += i;
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+void BM_write_mutable_span(benchmark::State& state) {
+    size_t const n = state.range(0);
+    auto v = make_sequence<socow_vector<uint64_t, 4>>(n);
+    for (auto _ : state) {
+        std::span<uint64_t> span = v.mutable_span();
+        for (size_t i = 0; i != n; ++i)
+            span[i] += i;
+        benchmark::ClobberMemory();
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// reads of a shared vector: the non-const operator[] detaches it once, on
+// the first call, and keeps checking afterwards
+void BM_read_shared_indexed(benchmark::State& state) {
+    size_t const n = state.range(0);
+    auto const a = make_sequence<socow_vector<uint64_t, 4>>(n);
+    for (auto _ : state) {
+        socow_vector<uint64_t, 4> v = a;
+        uint64_t sum = 0;
+        for (size_t i = 0; i != n; ++i)
+            sum += v[i];
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+void BM_read_shared_view(benchmark::State& state) {
+    size_t const n = state.range(0);
+    auto const a = make_sequence<socow_vector<uint64_t, 4>>(n);
+    for (auto _ : state) {
+        socow_vector<uint64_t, 4> v = a;
+        uint64_t sum = 0;
+        for (uint64_t x : v.view())
+            sum += x;
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+// overlapping windows of one large buffer, as handed out to workers
+void BM_windows_copied(benchmark::State& state) {
+    size_t const window = state.range(0);
+    auto const buffer = make_sequence<socow_vector<uint64_t, 4>>(1 << 20);
+    for (auto _ : state) {
+        for (size_t offset = 0; offset + window <= buffer.size(); offset += window / 2) {
+            std::vector<uint64_t> w(buffer.cbegin() + offset,
+                                    buffer.cbegin() + offset + window);
+            benchmark::DoNotOptimize(w.data());
+        }
+    }
+}
+
+void BM_windows_sliced(benchmark::State& state) {
+    size_t const window = state.range(0);
+    auto const buffer = make_sequence<socow_vector<uint64_t, 4>>(1 << 20);
+    for (auto _ : state) {
+        for (size_t offset = 0; offset + window <= buffer.size(); offset += window / 2) {
+            auto w = buffer.slice(offset, window);
+            benchmark::DoNotOptimize(w.cbegin());
+        }
+    }
+}
+
+// fork a 1M-element state and touch a few entries of the copy
+template <typename Vector>
+void BM_fork_and_touch(benchmark::State& state) {
+    size_t const touches = state.range(0);
+    Vector base;
+    for (size_t i = 0; i != (1 << 20); ++i)
+        base.push_back(i);
+    for (auto _ : state) {
+        Vector fork = base;
+        for (size_t i = 0; i != touches; ++i)
+            fork[(i * 7919) % base.size()] += 1;
+        benchmark::DoNotOptimize(fork);
+    }
+}
+
+// sparse edits of a fork of a 1M-element vector, range(0) edits per
+// million elements, followed by a full read when range(1) is set
+void BM_sparse_edits_detach(benchmark::State& state) {
+    size_t const edits = state.range(0);
+    auto const base = make_sequence<socow_vector<uint64_t, 4>>(1 << 20);
+    for (auto _ : state) {
+        socow_vector<uint64_t, 4> fork = base;
+        for (size_t i = 0; i != edits; ++i)
+            fork[(i * 7919) % base.size()] = i;
+        uint64_t sum = 0;
+        if (state.range(1)) {
+            for (size_t i = 0; i != fork.size(); ++i)
+                sum += fork.cdata()[i];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+}
+
+void BM_sparse_edits_overlay(benchmark::State& state) {
+    size_t const edits = state.range(0);
+    auto const base = make_sequence<socow_vector<uint64_t, 4>>(1 << 20);
+    for (auto _ : state) {
+        socow_overlay_vector<uint64_t, 4> fork(base);
+        for (size_t i = 0; i != edits; ++i)
+            fork.set((i * 7919) % base.size(), i);
+        uint64_t sum = 0;
+        if (state.range(1)) {
+            for (size_t i = 0; i != fork.size(); ++i)
+                sum += fork[i];
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+}
+
+// The regression suite: every operation over std::vector as the baseline
+// and socow_vector with a few SMALL_SIZE values, for a trivial, a string
+// and a non-trivial element type. Run it through the bench_json target.
+
+template <typename Vector>
+using value_of = std::decay_t<decltype(*std::declval<Vector>().begin())>;
+
+template <typename Vector>
+void BM_suite_push_back(benchmark::State& state) {
+    size_t const n = state.range(0);
+    value_of<Vector> const value = make_value<value_of<Vector>>(1);
+    for (auto _ : state) {
+        Vector v;
+        for (size_t i = 0; i != n; ++i)
+            v.push_back(value);
+        benchmark::DoNotOptimize(v.data());
+    }
+    state.SetItemsProcessed(state.iterations() * n);
+}
+
+template <typename Vector>
+void BM_suite_copy(benchmark::State& state) {
+    Vector const a = make_sequence<Vector>(state.range(0));
+    for (auto _ : state) {
+        Vector b = a;
+        benchmark::DoNotOptimize(b);
+    }
+}
+
+// a copy followed by the first write, which detaches a socow_vector
+template <typename Vector>
+void BM_suite_detach(benchmark::State& state) {
+    Vector const a = make_sequence<Vector>(state.range(0));
+    for (auto _ : state) {
+        Vector b = a;
+        benchmark::DoNotOptimize(b.data());
+    }
+}
+
+template <typename Vector>
+constexpr size_t small_size = 0;
+
+template <typename T, size_t SMALL_SIZE, typename RefCount, typename Allocator,
+          typename Growth, size_t Alignment, typename Stats>
+constexpr size_t small_size<socow_vector<T, SMALL_SIZE, RefCount, Allocator,
+                                         Growth, Alignment, Stats>> = SMALL_SIZE;
+
+static_assert(small_size<socow_vector<int, 4>> == 4);
+static_assert(small_size<socow_vector<std::string, 16>> == 16);
+
+// a small vector fills its SMALL_SIZE, a big one holds more than that
+template <typename Vector>
+void suite_swap(benchmark::State& state, bool first_big, bool second_big) {
+    size_t const small = small_size<Vector>;
+    Vector a = make_sequence<Vector>(first_big ? 4 * small + 1 : small);
+    Vector b = make_sequence<Vector>(second_big ? 4 * small + 1 : small);
+    for (auto _ : state) {
+        a.swap(b);
+        benchmark::DoNotOptimize(a);
+        benchmark::DoNotOptimize(b);
+    }
+}
+
+template <typename Vector>
+void BM_suite_swap_small_small(benchmark::State& state) {
+    suite_swap<Vector>(state, false, false);
+}
+
+template <typename Vector>
+void BM_suite_swap_big_small(benchmark::State& state) {
+    suite_swap<Vector>(state, true, false);
+}
+
+template <typename Vector>
+void BM_suite_swap_big_big(benchmark::State& state) {
+    suite_swap<Vector>(state, true, true);
+}
+
+// insert one element and erase it again, so the size stays at n
+template <typename Vector>
+void suite_insert_erase(benchmark::State& state, size_t index) {
+    Vector v = make_sequence<Vector>(state.range(0));
+    value_of<Vector> const value = make_value<value_of<Vector>>(1);
+    for (auto _ : state) {
+        v.insert(v.begin() + index, value);
+        v.erase(v.begin() + index);
+        benchmark::ClobberMemory();
+    }
+}
+
+template <typename Vector>
+void BM_suite_insert_erase_front(benchmark::State& state) {
+    suite_insert_erase<Vector>(state, 0);
+}
+
+template <typename Vector>
+void BM_suite_insert_erase_middle(benchmark::State& state) {
+    suite_insert_erase<Vector>(state, state.range(0) / 2);
+}
+
+template <typename Vector>
+void BM_suite_insert_erase_end(benchmark::State& state) {
+    suite_insert_erase<Vector>(state, state.range(0));
+}
+
+template <typename Vector>
+void BM_suite_shrink_to_fit(benchmark::State& state) {
+    size_t const n = state.range(0);
+    for (auto _ : state) {
+        state.PauseTiming();
+        Vector v = make_sequence<Vector>(n);
+        v.reserve(2 * n);
+        state.ResumeTiming();
+        v.shrink_to_fit();
+        benchmark::DoNotOptimize(v.data());
+    }
+}
+
+} // namespace
+
+BENCHMARK_TEMPLATE(BM_detach, uint64_t)->RangeMultiplier(16)->Range(1 << 8, 1 << 20);
+BENCHMARK_TEMPLATE(BM_detach, nontrivial_u64)->RangeMultiplier(16)->Range(1 << 8, 1 << 20);
+BENCHMARK_TEMPLATE(BM_growth, uint64_t)->RangeMultiplier(16)->Range(1 << 8, 1 << 20);
+BENCHMARK_TEMPLATE(BM_growth, nontrivial_u64)->RangeMultiplier(16)->Range(1 << 8, 1 << 20);
+BENCHMARK_TEMPLATE(BM_erase_front, uint64_t)->RangeMultiplier(16)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_erase_front, nontrivial_u64)->RangeMultiplier(16)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_share, socow::nonatomic_refcount);
+BENCHMARK_TEMPLATE(BM_share, socow::atomic_refcount);
+BENCHMARK_TEMPLATE(BM_share_threads, socow::atomic_refcount)->ThreadRange(1, 8);
+BENCHMARK(BM_frozen_share_threads)->ThreadRange(1, 8);
+BENCHMARK(BM_publish_atomic)->ThreadRange(1, 8);
+BENCHMARK(BM_publish_shared_mutex)->ThreadRange(1, 8);
+#if defined(SOCOW_HAS_POSIX)
+BENCHMARK(BM_load_file_push_back)->Range(1 << 10, 1 << 22);
+BENCHMARK(BM_load_file_mapped)->Range(1 << 10, 1 << 22);
+#endif
+BENCHMARK(BM_deserialize_elementwise)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_deserialize_bulk)->Range(1 << 10, 1 << 20);
+BENCHMARK(BM_parallel_detach)->RangeMultiplier(2)->Range(1, 8)->UseRealTime();
+BENCHMARK(BM_medium_vectors_malloc)->Range(16, 1 << 10);
+BENCHMARK(BM_medium_vectors_pool)->Range(16, 1 << 10);
+BENCHMARK(BM_buffer_push_back)->Range(1 << 10, 1 << 24);
+BENCHMARK(BM_buffer_resize)->Range(1 << 10, 1 << 24);
+BENCHMARK(BM_buffer_resize_for_overwrite)->Range(1 << 10, 1 << 24);
+BENCHMARK_TEMPLATE(BM_small_size_copy, socow_vector<int, 2>)->Arg(4)->Arg(8)->Arg(14);
+BENCHMARK_TEMPLATE(BM_small_size_copy, socow_vector<int, socow::small_size_for<int, 32>>)->Arg(4)->Arg(8)->Arg(14);
+BENCHMARK_TEMPLATE(BM_small_size_copy, socow_vector<int>)->Arg(4)->Arg(8)->Arg(14);
+BENCHMARK_TEMPLATE(BM_small_size_iterate, socow_vector<int, 2>)->Arg(4)->Arg(8)->Arg(14);
+BENCHMARK_TEMPLATE(BM_small_size_iterate, socow_vector<int, socow::small_size_for<int, 32>>)->Arg(4)->Arg(8)->Arg(14);
+BENCHMARK_TEMPLATE(BM_small_size_iterate, socow_vector<int>)->Arg(4)->Arg(8)->Arg(14);
+BENCHMARK(BM_request_scoped_heap)->Range(16, 1 << 12);
+BENCHMARK(BM_request_scoped_arena)->Range(16, 1 << 12);
+
+BENCHMARK_TEMPLATE(BM_insert_middle, socow_vector<uint64_t, 4>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_insert_middle, std::vector<uint64_t>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_insert_middle, socow_vector<std::string, 4>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_insert_middle, std::vector<std::string>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_insert_range_middle, socow_vector<uint64_t, 4>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_insert_range_middle, std::vector<uint64_t>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_erase_range, socow_vector<uint64_t, 4>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_erase_range, std::vector<uint64_t>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_erase_range, socow_vector<std::string, 4>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_erase_range, std::vector<std::string>)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_shared_erase, std::string, true)->Range(1 << 8, 1 << 14);
+BENCHMARK_TEMPLATE(BM_shared_erase, std::string, false)->Range(1 << 8, 1 << 14);
+BENCHMARK_TEMPLATE(BM_shared_erase, uint64_t, true)->Range(1 << 8, 1 << 14);
+BENCHMARK_TEMPLATE(BM_shared_erase, uint64_t, false)->Range(1 << 8, 1 << 14);
+BENCHMARK_TEMPLATE(BM_shared_pop_back, std::string, true)->Range(1 << 8, 1 << 14);
+BENCHMARK_TEMPLATE(BM_shared_pop_back, std::string, false)->Range(1 << 8, 1 << 14);
+
+BENCHMARK_TEMPLATE(BM_growth_policy, socow::growth_2x)->Range(1 << 8, 1 << 22);
+BENCHMARK_TEMPLATE(BM_growth_policy, socow::growth_1_5x)->Range(1 << 8, 1 << 22);
+BENCHMARK_TEMPLATE(BM_growth_policy, socow::size_class_growth<socow::growth_2x>)
+    ->Range(1 << 8, 1 << 22);
+BENCHMARK_TEMPLATE(BM_growth_policy, socow::size_class_growth<socow::growth_1_5x>)
+    ->Range(1 << 8, 1 << 22);
+#if defined(__linux__)
+BENCHMARK_TEMPLATE(BM_growth_policy_peak_rss, socow::growth_2x)
+    ->Arg(3'000'000)->Iterations(1);
+BENCHMARK_TEMPLATE(BM_growth_policy_peak_rss, socow::growth_1_5x)
+    ->Arg(3'000'000)->Iterations(1);
+BENCHMARK_TEMPLATE(BM_growth_policy_peak_rss, socow::size_class_growth<socow::growth_2x>)
+    ->Arg(3'000'000)->Iterations(1);
+#endif
+
+BENCHMARK_TEMPLATE(BM_append, realloc_vector)->RangeMultiplier(16)->Range(1 << 12, 1 << 24);
+BENCHMARK_TEMPLATE(BM_append, copy_vector)->RangeMultiplier(16)->Range(1 << 12, 1 << 24);
+BENCHMARK_TEMPLATE(BM_reserve_steps, realloc_vector)->Arg(1 << 22)->Arg(1 << 24);
+BENCHMARK_TEMPLATE(BM_reserve_steps, copy_vector)->Arg(1 << 22)->Arg(1 << 24);
+
+BENCHMARK(BM_nested_insert)->Range(1 << 8, 1 << 16);
+BENCHMARK(BM_nested_fill)->Range(1 << 8, 1 << 16);
+
+BENCHMARK_TEMPLATE(BM_write_indexed, socow_vector<uint64_t, 4>)->Range(1 << 4, 1 << 16);
+BENCHMARK_TEMPLATE(BM_write_indexed, std::vector<uint64_t>)->Range(1 << 4, 1 << 16);
+BENCHMARK(BM_write_mutable_span)->Range(1 << 4, 1 << 16);
+BENCHMARK(BM_read_shared_indexed)->Range(1 << 4, 1 << 16);
+BENCHMARK(BM_read_shared_view)->Range(1 << 4, 1 << 16);
+BENCHMARK(BM_windows_copied)->Range(1 << 8, 1 << 16);
+BENCHMARK(BM_windows_sliced)->Range(1 << 8, 1 << 16);
+BENCHMARK_TEMPLATE(BM_fork_and_touch, socow_vector<uint64_t, 4>)->Arg(1)->Arg(16);
+BENCHMARK_TEMPLATE(BM_fork_and_touch, socow_chunked_vector<uint64_t, 4>)->Arg(1)->Arg(16);
+BENCHMARK_TEMPLATE(BM_fork_and_touch, socow_chunked_vector<uint64_t, 4, 16384>)->Arg(1)->Arg(16);
+BENCHMARK(BM_sparse_edits_detach)->ArgsProduct({{1, 16, 256, 4096, 65536}, {0, 1}});
+BENCHMARK(BM_sparse_edits_overlay)->ArgsProduct({{1, 16, 256, 4096, 65536}, {0, 1}});
+
+#define SUITE_VECTORS(bm, T, args)                                               \
+    BENCHMARK_TEMPLATE(bm, std::vector<T>)->args;                                \
+    BENCHMARK_TEMPLATE(bm, socow_vector<T, 1>)->args;                            \
+    BENCHMARK_TEMPLATE(bm, socow_vector<T, 4>)->args;                            \
+    BENCHMARK_TEMPLATE(bm, socow_vector<T, 16>)->args
+
+#define SUITE(bm, args)                                                          \
+    SUITE_VECTORS(bm, int, args);                                                \
+    SUITE_VECTORS(bm, std::string, args);                                        \
+    SUITE_VECTORS(bm, nontrivial_u64, args)
+
+SUITE(BM_suite_push_back, Arg(8)->Arg(4096));
+SUITE(BM_suite_copy, Arg(8)->Arg(4096));
+SUITE(BM_suite_detach, Arg(8)->Arg(4096));
+SUITE(BM_suite_insert_erase_front, Arg(8)->Arg(4096));
+SUITE(BM_suite_insert_erase_middle, Arg(8)->Arg(4096));
+SUITE(BM_suite_insert_erase_end, Arg(8)->Arg(4096));
+SUITE(BM_suite_shrink_to_fit, Arg(8)->Arg(4096));
+SUITE(BM_suite_swap_small_small, Unit(benchmark::kNanosecond));
+SUITE(BM_suite_swap_big_small, Unit(benchmark::kNanosecond));
+SUITE(BM_suite_swap_big_big, Unit(benchmark::kNanosecond));
+
+BENCHMARK_MAIN();
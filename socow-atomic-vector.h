@@ -0,0 +1,115 @@
+#pragma once
+#include <cstddef>
+#include <atomic>
+#include <thread>
+#include <utility>
+
+#include "socow-vector.h"
+
+// A socow_vector published to many threads, in the style of
+// std::atomic<std::shared_ptr>: load() hands out a copy sharing the
+// published storage, writers copy it, modify the copy and store() or
+// compare_exchange() it back. Published vectors always live in a big
+// storage, so a load() only bumps the reference count and two vectors are
+// the same snapshot when they share the elements.
+//
+// Like libstdc++'s std::atomic<std::shared_ptr>, it is not lock-free: a
+// spin lock is held for the reference count increment or the handle swap,
+// and never while elements are copied or destroyed.
+template <typename T, size_t SMALL_SIZE>
+struct atomic_socow_vector {
+  using value_type = socow_vector<T, SMALL_SIZE, socow::atomic_refcount>;
+
+  static constexpr bool is_always_lock_free = false;
+
+  atomic_socow_vector() : atomic_socow_vector(value_type()) {}
+
+  explicit atomic_socow_vector(value_type desired)
+      : value_(publishable(std::move(desired))) {}
+
+  atomic_socow_vector(atomic_socow_vector const&) = delete;
+  atomic_socow_vector& operator=(atomic_socow_vector const&) = delete;
+
+  bool is_lock_free() const {
+    return false;
+  }
+
+  value_type load() const {
+    guard lock(locked_);
+    return value_;
+  }
+
+  operator value_type() const {
+    return load();
+  }
+
+  void store(value_type desired) {
+    exchange(std::move(desired));
+  }
+
+  atomic_socow_vector& operator=(value_type desired) {
+    store(std::move(desired));
+    return *this;
+  }
+
+  // the previously published vector; it is destroyed outside the lock
+  value_type exchange(value_type desired) {
+    desired = publishable(std::move(desired));
+    guard lock(locked_);
+    value_.swap(desired);
+    return desired;
+  }
+
+  // Publishes desired if expected is still the published snapshot (shares
+  // its storage), otherwise loads the published one into expected.
+  bool compare_exchange_strong(value_type& expected, value_type desired) {
+    desired = publishable(std::move(desired));
+    value_type previous;
+    {
+      guard lock(locked_);
+      if (same(expected, value_)) {
+        value_.swap(desired);
+        return true;
+      }
+      previous = value_;
+    }
+    expected = std::move(previous);
+    return false;
+  }
+
+  bool compare_exchange_weak(value_type& expected, value_type desired) {
+    return compare_exchange_strong(expected, std::move(desired));
+  }
+
+private:
+  struct guard {
+    explicit guard(std::atomic<bool>& locked) : locked_(locked) {
+      while (locked_.exchange(true, std::memory_order_acquire)) {
+        while (locked_.load(std::memory_order_relaxed)) {
+          std::this_thread::yield();
+        }
+      }
+    }
+
+    ~guard() {
+      locked_.store(false, std::memory_order_release);
+    }
+
+    std::atomic<bool>& locked_;
+  };
+
+  // moves a small vector into a big storage, so copies of it share one
+  static value_type publishable(value_type v) {
+    if (v.capacity() <= SMALL_SIZE) {
+      v.reserve(SMALL_SIZE + 1);
+    }
+    return v;
+  }
+
+  static bool same(value_type const& a, value_type const& b) {
+    return a.cdata() == b.cdata() && a.size() == b.size();
+  }
+
+  mutable std::atomic<bool> locked_{false};
+  value_type value_;
+};
@@ -0,0 +1,238 @@
+#pragma once
+#include <cstddef>
+#include <algorithm>
+#include <iterator>
+#include <utility>
+
+#include "socow-vector.h"
+
+namespace socow::detail {
+
+// grows a chunk like growth_2x, but never past CHUNK elements
+template <size_t CHUNK>
+struct chunk_growth {
+  static constexpr bool round_to_size_class = false;
+
+  static size_t next_capacity(size_t capacity, size_t required) {
+    return std::max(required, std::min(CHUNK, capacity * 2));
+  }
+};
+
+} // namespace socow::detail
+
+// A copy-on-write vector split into chunks of CHUNK elements. Both the
+// chunks and the table of chunks are socow_vectors, so copies share
+// everything, and a write into a copy detaches the table (one handle per
+// chunk) and the one chunk it lands in instead of all the elements. Up to
+// SMALL_SIZE elements live inline, as in socow_vector.
+template <typename T, size_t SMALL_SIZE, size_t CHUNK = 1024,
+          typename RefCount = socow::nonatomic_refcount>
+struct socow_chunked_vector {
+  static_assert(CHUNK > SMALL_SIZE,
+                "a full chunk must live in a storage of its own");
+
+  using value_type = T;
+  using chunk_type = socow_vector<T, SMALL_SIZE, RefCount, std::allocator<T>,
+                                  socow::detail::chunk_growth<CHUNK>>;
+
+  struct const_iterator {
+    using iterator_category = std::random_access_iterator_tag;
+    using value_type = T;
+    using difference_type = ptrdiff_t;
+    using pointer = T const*;
+    using reference = T const&;
+
+    const_iterator() = default;
+
+    reference operator*() const {
+      return (*owner_)[index_];
+    }
+
+    pointer operator->() const {
+      return &**this;
+    }
+
+    reference operator[](difference_type n) const {
+      return (*owner_)[index_ + n];
+    }
+
+    const_iterator& operator++() {
+      ++index_;
+      return *this;
+    }
+
+    const_iterator operator++(int) {
+      const_iterator ans = *this;
+      ++index_;
+      return ans;
+    }
+
+    const_iterator& operator--() {
+      --index_;
+      return *this;
+    }
+
+    const_iterator operator--(int) {
+      const_iterator ans = *this;
+      --index_;
+      return ans;
+    }
+
+    const_iterator& operator+=(difference_type n) {
+      index_ += n;
+      return *this;
+    }
+
+    const_iterator& operator-=(difference_type n) {
+      index_ -= n;
+      return *this;
+    }
+
+    friend const_iterator operator+(const_iterator it, difference_type n) {
+      return it += n;
+    }
+
+    friend const_iterator operator+(difference_type n, const_iterator it) {
+      return it += n;
+    }
+
+    friend const_iterator operator-(const_iterator it, difference_type n) {
+      return it -= n;
+    }
+
+    friend difference_type operator-(const_iterator a, const_iterator b) {
+      return difference_type(a.index_) - difference_type(b.index_);
+    }
+
+    friend bool operator==(const_iterator a, const_iterator b) {
+      return a.index_ == b.index_;
+    }
+
+    friend bool operator!=(const_iterator a, const_iterator b) {
+      return a.index_ != b.index_;
+    }
+
+    friend bool operator<(const_iterator a, const_iterator b) {
+      return a.index_ < b.index_;
+    }
+
+    friend bool operator>(const_iterator a, const_iterator b) {
+      return a.index_ > b.index_;
+    }
+
+    friend bool operator<=(const_iterator a, const_iterator b) {
+      return a.index_ <= b.index_;
+    }
+
+    friend bool operator>=(const_iterator a, const_iterator b) {
+      return a.index_ >= b.index_;
+    }
+
+  private:
+    friend struct socow_chunked_vector;
+
+    const_iterator(socow_chunked_vector const* owner, size_t index)
+        : owner_(owner), index_(index) {}
+
+    socow_chunked_vector const* owner_ = nullptr;
+    size_t index_ = 0;
+  };
+
+  socow_chunked_vector() : size_(0) {}
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  size_t chunk_count() const {
+    return chunks_.size();
+  }
+
+  T const& operator[](size_t i) const {
+    return chunks_.cbegin()[i / CHUNK].cbegin()[i % CHUNK];
+  }
+
+  // copies the table and one chunk if they are shared
+  T& operator[](size_t i) {
+    return chunks_[i / CHUNK][i % CHUNK];
+  }
+
+  T const& front() const {
+    return (*this)[0];
+  }
+
+  T& front() {
+    return (*this)[0];
+  }
+
+  T const& back() const {
+    return (*this)[size_ - 1];
+  }
+
+  T& back() {
+    return (*this)[size_ - 1];
+  }
+
+  const_iterator begin() const {
+    return {this, 0};
+  }
+
+  const_iterator end() const {
+    return {this, size_};
+  }
+
+  const_iterator cbegin() const {
+    return begin();
+  }
+
+  const_iterator cend() const {
+    return end();
+  }
+
+  void push_back(T const& element) {
+    emplace_back(element);
+  }
+
+  void push_back(T&& element) {
+    emplace_back(std::move(element));
+  }
+
+  // Full chunks are big, so growing the table never moves elements and
+  // args may refer to this vector.
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    if (size_ % CHUNK == 0) {
+      chunks_.emplace_back();
+    }
+    T& ans = chunks_.back().emplace_back(std::forward<Args>(args)...);
+    ++size_;
+    return ans;
+  }
+
+  void pop_back() {
+    chunk_type& last = chunks_.back();
+    last.pop_back();
+    if (last.empty()) {
+      chunks_.pop_back();
+    }
+    --size_;
+  }
+
+  void clear() {
+    chunks_.clear();
+    size_ = 0;
+  }
+
+  void swap(socow_chunked_vector& other) {
+    chunks_.swap(other.chunks_);
+    std::swap(size_, other.size_);
+  }
+
+private:
+  socow_vector<chunk_type, 1, RefCount> chunks_;
+  size_t size_;
+};
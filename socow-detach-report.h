@@ -0,0 +1,120 @@
+#pragma once
+#include <cstddef>
+#include <cstdio>
+#include <cstdlib>
+#include <algorithm>
+#include <map>
+#include <mutex>
+#include <utility>
+#include <vector>
+
+#include <execinfo.h>
+
+#include "socow-vector.h"
+
+namespace socow {
+
+// A Stats policy that finds out who makes socow_vector copy: every detach
+// captures a backtrace, and the bytes copied are summed up per distinct
+// backtrace. Detaches are easy to trigger by accident, any non-const
+// operator[], front() or data() on a shared vector copies it. The report,
+// heaviest site first, is written to stderr at exit. Link with -rdynamic to
+// get function names instead of bare addresses.
+//
+// Meant for diagnostic builds: a detach takes a lock and walks the stack.
+struct detach_report {
+  struct site {
+    std::vector<void*> frames;
+    size_t detaches = 0;
+    size_t bytes = 0;
+  };
+
+  static void record(stat s, size_t amount = 1) {
+    if (s != stat::detached_bytes) {
+      return;
+    }
+    void* frames[max_frames];
+    int depth = backtrace(frames, max_frames);
+    registry& r = instance();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    site& entry = r.sites[std::vector<void*>(frames, frames + depth)];
+    entry.detaches++;
+    entry.bytes += amount;
+  }
+
+  // the sites seen so far, most bytes first
+  static std::vector<site> sites() {
+    return instance().sorted();
+  }
+
+  static void write(std::FILE* out) {
+    instance().write(out);
+  }
+
+  static void reset() {
+    registry& r = instance();
+    std::lock_guard<std::mutex> lock(r.mutex);
+    r.sites.clear();
+  }
+
+private:
+  static constexpr int max_frames = 24;
+
+  struct registry {
+    ~registry() {
+      if (!sites.empty()) {
+        write(stderr);
+      }
+    }
+
+    std::vector<site> sorted() {
+      std::vector<site> ans;
+      {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto const& [frames, entry] : sites) {
+          ans.push_back({frames, entry.detaches, entry.bytes});
+        }
+      }
+      std::stable_sort(ans.begin(), ans.end(),
+                       [](site const& a, site const& b) {
+                         return a.bytes > b.bytes;
+                       });
+      return ans;
+    }
+
+    void write(std::FILE* out) {
+      std::vector<site> all = sorted();
+      size_t detaches = 0, bytes = 0;
+      for (site const& s : all) {
+        detaches += s.detaches;
+        bytes += s.bytes;
+      }
+      std::fprintf(out, "socow_vector detaches: %zu, %zu bytes, %zu sites\n",
+                   detaches, bytes, all.size());
+      for (size_t i = 0; i != all.size(); ++i) {
+        std::fprintf(out, "#%zu: %zu bytes in %zu detaches\n", i + 1,
+                     all[i].bytes, all[i].detaches);
+        int depth = static_cast<int>(all[i].frames.size());
+        char** symbols = backtrace_symbols(all[i].frames.data(), depth);
+        for (int k = 0; k != depth; ++k) {
+          if (symbols != nullptr) {
+            std::fprintf(out, "    %s\n", symbols[k]);
+          } else {
+            std::fprintf(out, "    %p\n", all[i].frames[k]);
+          }
+        }
+        std::free(symbols);
+      }
+    }
+
+    std::mutex mutex;
+    std::map<std::vector<void*>, site> sites;
+  };
+
+  static registry& instance() {
+    static registry r;
+    return r;
+  }
+};
+
+} // namespace socow
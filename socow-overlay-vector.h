@@ -0,0 +1,169 @@
+#pragma once
+#include <cstddef>
+#include <algorithm>
+#include <utility>
+#include <vector>
+
+#include "socow-vector.h"
+
+// A socow_vector that records writes into a shared storage as patches
+// instead of copying it. The patches are kept per owner, sorted by index,
+// and reads look them up first. Once there are more patches than
+// max_overlay_fraction() of the size, the vector is compacted: the storage
+// is detached once and the patches are applied to it. Writes into a storage
+// nobody else refers to go straight to the elements.
+//
+// Meant for forks of a big vector that change only a few elements; reads
+// pay a binary search while any patch is pending.
+template <typename T, size_t SMALL_SIZE,
+          typename RefCount = socow::nonatomic_refcount>
+struct socow_overlay_vector {
+  using value_type = T;
+  using base_type = socow_vector<T, SMALL_SIZE, RefCount>;
+
+  socow_overlay_vector() = default;
+
+  explicit socow_overlay_vector(base_type base) : base_(std::move(base)) {}
+
+  size_t size() const {
+    return base_.size();
+  }
+
+  bool empty() const {
+    return base_.empty();
+  }
+
+  size_t overlay_size() const {
+    return overlay_.size();
+  }
+
+  double max_overlay_fraction() const {
+    return max_overlay_fraction_;
+  }
+
+  void set_max_overlay_fraction(double fraction) {
+    max_overlay_fraction_ = fraction;
+    compact_if_needed();
+  }
+
+  T const& operator[](size_t i) const {
+    if (!overlay_.empty()) {
+      auto it = find(i);
+      if (it != overlay_.end() && it->first == i) {
+        return it->second;
+      }
+    }
+    return base_.cdata()[i];
+  }
+
+  T const& front() const {
+    return (*this)[0];
+  }
+
+  T const& back() const {
+    return (*this)[size() - 1];
+  }
+
+  void set(size_t i, T const& value) {
+    emplace_at(i, value);
+  }
+
+  void set(size_t i, T&& value) {
+    emplace_at(i, std::move(value));
+  }
+
+  void push_back(T const& element) {
+    emplace_back(element);
+  }
+
+  void push_back(T&& element) {
+    emplace_back(std::move(element));
+  }
+
+  // a change of size detaches the storage anyway, so the patches go with it
+  template <typename... Args>
+  void emplace_back(Args&&... args) {
+    if (overlay_.empty()) {
+      base_.emplace_back(std::forward<Args>(args)...);
+      return;
+    }
+    T element(std::forward<Args>(args)...);
+    compact();
+    base_.push_back(std::move(element));
+  }
+
+  void pop_back() {
+    compact();
+    base_.pop_back();
+  }
+
+  void clear() {
+    overlay_.clear();
+    base_.clear();
+  }
+
+  // applies the patches to a storage of this vector's own
+  void compact() {
+    if (overlay_.empty()) {
+      return;
+    }
+    T* data = base_.data();
+    for (auto& [index, value] : overlay_) {
+      data[index] = std::move(value);
+    }
+    overlay_.clear();
+  }
+
+  // the elements with the patches applied
+  base_type const& base() {
+    compact();
+    return base_;
+  }
+
+  void swap(socow_overlay_vector& other) {
+    base_.swap(other.base_);
+    overlay_.swap(other.overlay_);
+    std::swap(max_overlay_fraction_, other.max_overlay_fraction_);
+  }
+
+private:
+  using patch = std::pair<size_t, T>;
+
+  typename std::vector<patch>::const_iterator find(size_t i) const {
+    return std::lower_bound(
+        overlay_.begin(), overlay_.end(), i,
+        [](patch const& p, size_t index) { return p.first < index; });
+  }
+
+  template <typename U>
+  void emplace_at(size_t i, U&& value) {
+    if (!base_.is_shared()) {
+      if (!overlay_.empty()) {
+        // value may be one of the patches compact() moves from
+        T element(std::forward<U>(value));
+        compact();
+        base_.data()[i] = std::move(element);
+        return;
+      }
+      base_.data()[i] = std::forward<U>(value);
+      return;
+    }
+    auto it = overlay_.begin() + (find(i) - overlay_.cbegin());
+    if (it != overlay_.end() && it->first == i) {
+      it->second = std::forward<U>(value);
+      return;
+    }
+    overlay_.emplace(it, i, std::forward<U>(value));
+    compact_if_needed();
+  }
+
+  void compact_if_needed() {
+    if (overlay_.size() > max_overlay_fraction_ * size()) {
+      compact();
+    }
+  }
+
+  base_type base_;
+  std::vector<patch> overlay_;
+  double max_overlay_fraction_ = 1.0 / 1024;
+};
@@ -0,0 +1,250 @@
+#pragma once
+#include <cstddef>
+#include <algorithm>
+#include <bit>
+#include <new>
+#include <type_traits>
+
+#include "socow-vector.h"
+
+namespace socow {
+
+// Blocks freed by a thread, kept for its next allocations of the same
+// size class. Classes are powers of two, each with its own free list; a
+// block of up to max_pooled_bytes is rounded up to its class when it is
+// first allocated, and block_bytes() tells its real size. Blocks bigger
+// than max_block_bytes() or over-aligned ones are not cached, and
+// a class holds at most max_blocks_per_class() blocks. The settings and
+// counters are per thread. A thread's blocks are freed when it exits or
+// calls trim().
+//
+// A block may be freed by another thread than the one that allocated it;
+// it then goes to that thread's lists.
+struct block_pool {
+  struct counters {
+    size_t hits = 0;
+    size_t misses = 0;
+  };
+
+  // blocks up to this size are allocated rounded up to their class, so
+  // that any of them can be cached when it is freed; bigger ones are never
+  // cached and keep their size
+  static constexpr size_t max_pooled_bytes = size_t(1) << 16;
+
+  static void* allocate(size_t bytes, size_t alignment) {
+    cache& c = local();
+    if (!poolable(bytes, alignment)) {
+      c.counts.misses++;
+      return allocate_uncached(bytes, alignment);
+    }
+    size_t cls = size_class(bytes);
+    if (free_block* block = c.heads[cls]) {
+      c.heads[cls] = block->next;
+      c.lengths[cls]--;
+      c.cached_bytes -= size_t(1) << cls;
+      c.counts.hits++;
+      return block;
+    }
+    c.counts.misses++;
+    return ::operator new(size_t(1) << cls);
+  }
+
+  static void deallocate(void* p, size_t bytes, size_t alignment) noexcept {
+    if (!poolable(bytes, alignment)) {
+      deallocate_uncached(p, alignment);
+      return;
+    }
+    cache& c = local();
+    size_t cls = size_class(bytes);
+    if (bytes > c.max_block_bytes ||
+        c.lengths[cls] >= c.max_blocks_per_class || !register_cleanup()) {
+      ::operator delete(p);
+      return;
+    }
+    c.heads[cls] = new (p) free_block{c.heads[cls]};
+    c.lengths[cls]++;
+    c.cached_bytes += size_t(1) << cls;
+  }
+
+  // the size of the block allocate(bytes, alignment) hands out
+  static size_t block_bytes(size_t bytes, size_t alignment) {
+    if (!poolable(bytes, alignment)) {
+      return bytes;
+    }
+    return size_t(1) << size_class(bytes);
+  }
+
+  // frees every block the calling thread keeps
+  static void trim() noexcept {
+    cache& c = local();
+    for (size_t cls = 0; cls != class_count; ++cls) {
+      while (free_block* block = c.heads[cls]) {
+        c.heads[cls] = block->next;
+        ::operator delete(block);
+      }
+      c.lengths[cls] = 0;
+    }
+    c.cached_bytes = 0;
+  }
+
+  static size_t cached_bytes() {
+    return local().cached_bytes;
+  }
+
+  static size_t max_blocks_per_class() {
+    return local().max_blocks_per_class;
+  }
+
+  // lists longer than n are cut down right away
+  static void set_max_blocks_per_class(size_t n) {
+    cache& c = local();
+    c.max_blocks_per_class = n;
+    for (size_t cls = 0; cls != class_count; ++cls) {
+      while (c.lengths[cls] > n) {
+        free_block* block = c.heads[cls];
+        c.heads[cls] = block->next;
+        c.lengths[cls]--;
+        c.cached_bytes -= size_t(1) << cls;
+        ::operator delete(block);
+      }
+    }
+  }
+
+  static size_t max_block_bytes() {
+    return local().max_block_bytes;
+  }
+
+  // at most max_pooled_bytes; cached blocks above the new limit stay
+  // until trim()
+  static void set_max_block_bytes(size_t bytes) {
+    local().max_block_bytes = std::min(bytes, max_pooled_bytes);
+  }
+
+  // hits are allocations served from a free list, misses went to
+  // operator new
+  static counters stats() {
+    return local().counts;
+  }
+
+  static void reset_stats() {
+    local().counts = {};
+  }
+
+private:
+  struct free_block {
+    free_block* next;
+  };
+
+  static constexpr size_t min_class = 4;
+  static constexpr size_t class_count = sizeof(size_t) * 8;
+
+  // Trivially destructible, so that blocks freed by the destructors of
+  // other thread_locals after cleanup ran still find a (disabled) cache.
+  struct cache {
+    free_block* heads[class_count];
+    size_t lengths[class_count];
+    size_t cached_bytes;
+    size_t max_blocks_per_class = 64;
+    size_t max_block_bytes = max_pooled_bytes;
+    counters counts;
+    bool exiting;
+  };
+
+  struct cleanup {
+    ~cleanup() {
+      trim();
+      local().exiting = true;
+    }
+  };
+
+  static cache& local() {
+    thread_local cache c{};
+    return c;
+  }
+
+  // makes the thread free its blocks when it exits; false once it does
+  static bool register_cleanup() {
+    thread_local cleanup registered;
+    return !local().exiting;
+  }
+
+  static size_t size_class(size_t bytes) {
+    // a zero-byte block gets the smallest class
+    return std::max<size_t>(min_class,
+                            std::bit_width(std::max<size_t>(bytes, 1) - 1));
+  }
+
+  static bool poolable(size_t bytes, size_t alignment) {
+    return alignment <= __STDCPP_DEFAULT_NEW_ALIGNMENT__ &&
+           bytes <= max_pooled_bytes;
+  }
+
+  static void* allocate_uncached(size_t bytes, size_t alignment) {
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+      return ::operator new(bytes, std::align_val_t(alignment));
+    }
+    return ::operator new(bytes);
+  }
+
+  static void deallocate_uncached(void* p, size_t alignment) noexcept {
+    if (alignment > __STDCPP_DEFAULT_NEW_ALIGNMENT__) {
+      ::operator delete(p, std::align_val_t(alignment));
+    } else {
+      ::operator delete(p);
+    }
+  }
+};
+
+// What allocate_at_least() returns, like C++23's std::allocation_result.
+template <typename Pointer>
+struct allocation_result {
+  Pointer ptr;
+  size_t count;
+};
+
+// A stateless allocator taking its blocks from the calling thread's
+// block_pool; for socow_vectors that are created and dropped at a high rate.
+template <typename T>
+struct pool_allocator {
+  using value_type = T;
+  using is_always_equal = std::true_type;
+
+  pool_allocator() = default;
+
+  template <typename U>
+  pool_allocator(pool_allocator<U> const&) {}
+
+  T* allocate(size_t n) {
+    return static_cast<T*>(block_pool::allocate(n * sizeof(T), alignof(T)));
+  }
+
+  // Like C++23's allocate_at_least: count is how many T fit in the block
+  // once it is rounded up to its size class. deallocate() takes any n
+  // between the requested one and count.
+  allocation_result<T*> allocate_at_least(size_t n) {
+    size_t bytes = block_pool::block_bytes(n * sizeof(T), alignof(T));
+    return {allocate(n), bytes / sizeof(T)};
+  }
+
+  void deallocate(T* p, size_t n) noexcept {
+    block_pool::deallocate(p, n * sizeof(T), alignof(T));
+  }
+
+  friend bool operator==(pool_allocator const&, pool_allocator const&) {
+    return true;
+  }
+
+  friend bool operator!=(pool_allocator const&, pool_allocator const&) {
+    return false;
+  }
+};
+
+template <typename T, size_t SMALL_SIZE = small_size_for<T>,
+          typename RefCount = socow::nonatomic_refcount,
+          typename Growth = socow::growth_2x,
+          size_t Alignment = alignof(T),
+          typename Stats = socow::no_stats>
+using pooled_vector = socow_vector<T, SMALL_SIZE, RefCount, pool_allocator<T>,
+                                   Growth, Alignment, Stats>;
+
+} // namespace socow
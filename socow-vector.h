@@ -1,39 +1,595 @@
 #pragma once
 #include <cstddef>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <algorithm>
+#include <atomic>
+#include <exception>
+#include <initializer_list>
+#include <istream>
+#include <iterator>
+#include <memory>
+#if __has_include(<memory_resource>)
+#include <memory_resource>
+#endif
+#include <new>
+#include <ostream>
+#include <stdexcept>
+#include <thread>
+#if __has_include(<sys/mman.h>) && __has_include(<unistd.h>)
+#include <cerrno>
+#include <system_error>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#define SOCOW_HAS_POSIX 1
+#endif
+#if __cplusplus >= 202002L && __has_include(<span>)
+#include <span>
+#define SOCOW_HAS_SPAN 1
+#endif
+#include <type_traits>
+#include <utility>
+#if defined(__GLIBC__)
+#include <malloc.h>
+#endif
 
-template <typename T, size_t SMALL_SIZE>
-struct socow_vector {
+namespace socow {
+
+// Reference count of a shared storage. Only copies of one socow_vector
+// living in a single thread may share it.
+struct nonatomic_refcount {
+  explicit nonatomic_refcount(size_t value) : value_(value) {}
+
+  void inc() {
+    ++value_;
+  }
+
+  // returns true when the last reference is gone
+  bool dec() {
+    return --value_ == 0;
+  }
+
+  bool is_shared() const {
+    return value_ > 1;
+  }
+
+private:
+  size_t value_;
+};
+
+// Lets copies sharing one storage live in different threads; a single
+// socow_vector object still must not be mutated concurrently. dec() releases
+// our accesses to the elements and is_shared() acquires everyone else's.
+struct atomic_refcount {
+  explicit atomic_refcount(size_t value) : value_(value) {}
+
+  void inc() {
+    value_.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  bool dec() {
+    return value_.fetch_sub(1, std::memory_order_acq_rel) == 1;
+  }
+
+  bool is_shared() const {
+    return value_.load(std::memory_order_acquire) > 1;
+  }
+
+private:
+  std::atomic<size_t> value_;
+};
+
+// Growth policies: next_capacity() picks the capacity of a new buffer once
+// size() reaches capacity(), required is the size it has to fit.
+struct growth_2x {
+  static constexpr bool round_to_size_class = false;
+
+  static size_t next_capacity(size_t capacity, size_t required) {
+    return std::max(required, capacity * 2);
+  }
+};
+
+struct growth_1_5x {
+  static constexpr bool round_to_size_class = false;
+
+  static size_t next_capacity(size_t capacity, size_t required) {
+    return std::max(required, capacity + capacity / 2);
+  }
+};
+
+// Grows like Base, then keeps all the room the allocator actually handed
+// back. Only the default allocator (which allocates with malloc) reports it,
+// through malloc_usable_size on glibc.
+template <typename Base = growth_2x>
+struct size_class_growth : Base {
+  static constexpr bool round_to_size_class = true;
+};
+
+// The most elements of T a socow_vector keeps inline while its size stays
+// within BYTES: the size word comes first, then the inline elements, which
+// share their room with the big storage pointer. Extra words in front (a
+// stateful allocator) go to HEADER. The default SMALL_SIZE fills a cache
+// line; it is at least 1, so elements that do not fit at all still get a
+// (bigger) vector with one of them inline rather than a zero-size array.
+template <typename T, size_t BYTES = 64, size_t Alignment = alignof(T),
+          size_t HEADER = 0>
+inline constexpr size_t small_size_for = [] {
+  size_t align = std::max(Alignment, alignof(void*));
+  size_t header = (HEADER + sizeof(size_t) + align - 1) / align * align;
+  return std::max<size_t>(1, BYTES > header ? (BYTES - header) / sizeof(T)
+                                            : 0);
+}();
+
+// Copies of at least threshold elements of T, when a shared storage is
+// detached or copied, are split across threads(). Off by default; turn it
+// on for a type by specializing, e.g.
+//   template <> struct socow::parallel_copy<std::string>
+//       : socow::parallel_copy_above<1 << 16> {};
+// Only for types whose distinct objects may be copied concurrently, which
+// rules out nested socow_vectors with nonatomic_refcount.
+template <typename T>
+struct parallel_copy {
+  static constexpr size_t threshold = 0;
+
+  static unsigned threads() {
+    return 1;
+  }
+};
+
+// THREADS == 0 uses every hardware thread
+template <size_t THRESHOLD, unsigned THREADS = 0>
+struct parallel_copy_above {
+  static constexpr size_t threshold = THRESHOLD;
+
+  static unsigned threads() {
+    return THREADS != 0 ? THREADS
+                        : std::max(1u, std::thread::hardware_concurrency());
+  }
+};
+
+// Events a Stats policy of socow_vector is told about. Every event comes
+// with an amount: bytes for allocated_bytes and detached_bytes, elements for
+// elements_copied and 1 for the rest. detached_bytes is recorded right after
+// the detaches event it belongs to.
+enum class stat {
+  allocations,
+  reallocations,
+  frees,
+  allocated_bytes,
+  detaches,
+  detached_bytes,
+  elements_copied,
+  small_to_big,
+  big_to_small,
+  small_small_swaps,
+  small_big_swaps,
+  big_big_swaps,
+};
+
+inline constexpr size_t stat_count = size_t(stat::big_big_swaps) + 1;
+
+inline char const* stat_name(stat s) {
+  static char const* const names[stat_count] = {
+      "allocations",       "reallocations",   "frees",
+      "allocated_bytes",   "detaches",        "detached_bytes",
+      "elements_copied",   "small_to_big",    "big_to_small",
+      "small_small_swaps", "small_big_swaps", "big_big_swaps",
+  };
+  return names[size_t(s)];
+}
+
+struct stats_snapshot {
+  size_t operator[](stat s) const {
+    return counts[size_t(s)];
+  }
+
+  size_t counts[stat_count] = {};
+};
+
+// The default: records nothing and compiles away.
+struct no_stats {
+  static void record(stat, size_t = 1) {}
+};
+
+// Counters of the calling thread, plain increments.
+struct thread_stats {
+  static void record(stat s, size_t amount = 1) {
+    counters().counts[size_t(s)] += amount;
+  }
+
+  static stats_snapshot snapshot() {
+    return counters();
+  }
+
+  static void reset() {
+    counters() = {};
+  }
+
+private:
+  static stats_snapshot& counters() {
+    thread_local stats_snapshot counters;
+    return counters;
+  }
+};
+
+// Process-wide counters, relaxed atomic increments.
+struct global_stats {
+  static void record(stat s, size_t amount = 1) {
+    counts[size_t(s)].fetch_add(amount, std::memory_order_relaxed);
+  }
+
+  static stats_snapshot snapshot() {
+    stats_snapshot ans;
+    for (size_t i = 0; i != stat_count; ++i) {
+      ans.counts[i] = counts[i].load(std::memory_order_relaxed);
+    }
+    return ans;
+  }
+
+  static void reset() {
+    for (auto& count : counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
+  }
+
+private:
+  inline static std::atomic<size_t> counts[stat_count] = {};
+};
+
+// Precedes the elements in the binary format of socow_vector::write_to().
+// The elements are stored as they are laid out in memory, so a reader must
+// agree on the element size and the byte order.
+struct binary_header {
+  static constexpr char magic_value[4] = {'S', 'O', 'C', 'W'};
+  static constexpr uint16_t current_version = 1;
+
+  char magic[4];
+  uint8_t little_endian;
+  uint8_t reserved;
+  uint16_t version;
+  uint64_t element_size;
+  uint64_t count;
+};
+
+namespace detail {
+
+inline bool is_little_endian() {
+  uint16_t probe = 1;
+  unsigned char first;
+  std::memcpy(&first, &probe, 1);
+  return first == 1;
+}
+
+// Copy-constructs count elements into raw memory, split into shards
+// copied by their own threads (the calling thread takes the first one).
+// If any shard throws, every element built by the others is destroyed
+// and the first exception is rethrown.
+template <typename T>
+void parallel_copy_construct(T const* from, T* to, size_t count,
+                             unsigned threads) {
+  size_t shards = std::max<size_t>(1, std::min<size_t>(threads, count));
+  std::unique_ptr<std::exception_ptr[]> errors(
+      new std::exception_ptr[shards]);
+  auto bound = [&](size_t k) {
+    return count / shards * k + std::min(k, count % shards);
+  };
+  auto copy_shard = [&](size_t k) {
+    size_t i = bound(k);
+    try {
+      for (; i != bound(k + 1); ++i) {
+        new (to + i) T(from[i]);
+      }
+    } catch (...) {
+      std::destroy(to + bound(k), to + i);
+      errors[k] = std::current_exception();
+    }
+  };
+
+  std::unique_ptr<std::thread[]> workers(new std::thread[shards - 1]);
+  size_t started = 0;
+  try {
+    for (; started != shards - 1; ++started) {
+      workers[started] = std::thread(copy_shard, started + 1);
+    }
+  } catch (...) {
+    // out of threads, the rest is copied here
+    for (size_t k = started + 1; k != shards; ++k) {
+      copy_shard(k);
+    }
+  }
+  copy_shard(0);
+  for (size_t k = 0; k != started; ++k) {
+    workers[k].join();
+  }
+
+  std::exception_ptr error;
+  for (size_t k = 0; k != shards; ++k) {
+    if (errors[k] != nullptr && error == nullptr) {
+      error = errors[k];
+    }
+  }
+  if (error != nullptr) {
+    for (size_t k = 0; k != shards; ++k) {
+      if (errors[k] == nullptr) {
+        std::destroy(to + bound(k), to + bound(k + 1));
+      }
+    }
+    std::rethrow_exception(error);
+  }
+}
+
+inline size_t usable_size(void* block, size_t requested) {
+#if defined(__GLIBC__)
+  (void)requested;
+  return malloc_usable_size(block);
+#else
+  (void)block;
+  return requested;
+#endif
+}
+
+struct adopt_t {};
+
+#if defined(SOCOW_HAS_POSIX)
+struct file_descriptor {
+  ~file_descriptor() {
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  int fd;
+};
+
+// Maps the first bytes of a file read-only at an address aligned to
+// alignment, right behind at least header writable anonymous bytes (whole
+// pages) for a header. Returns where the file's bytes start.
+inline void* map_after_header(int fd, size_t header, size_t alignment,
+                              size_t bytes) {
+  size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  size_t header_space = (header + page - 1) / page * page;
+  size_t align = std::max(alignment, page);
+  size_t reserved = header_space + bytes + (align - page);
+  void* base = ::mmap(nullptr, reserved, PROT_READ | PROT_WRITE,
+                      MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (base == MAP_FAILED) {
+    throw std::system_error(errno, std::generic_category(), "mmap");
+  }
+  // give back the pages an over-aligned start leaves on either side
+  auto first = reinterpret_cast<uintptr_t>(base);
+  auto data = (first + header_space + align - 1) / align * align;
+  uintptr_t start = data - header_space;
+  uintptr_t end = (data + bytes + page - 1) / page * page;
+  uintptr_t last = (first + reserved + page - 1) / page * page;
+  if (start != first) {
+    ::munmap(base, start - first);
+  }
+  if (end != last) {
+    ::munmap(reinterpret_cast<void*>(end), last - end);
+  }
+  if (::mmap(reinterpret_cast<void*>(data), bytes, PROT_READ,
+             MAP_SHARED | MAP_FIXED, fd, 0) == MAP_FAILED) {
+    int error = errno;
+    ::munmap(reinterpret_cast<void*>(start), end - start);
+    throw std::system_error(error, std::generic_category(), "mmap");
+  }
+  return reinterpret_cast<void*>(data);
+}
+
+inline void unmap_after_header(void* data, size_t header, size_t bytes) {
+  size_t page = static_cast<size_t>(::sysconf(_SC_PAGESIZE));
+  size_t header_space = (header + page - 1) / page * page;
+  ::munmap(static_cast<unsigned char*>(data) - header_space,
+           header_space + bytes);
+}
+
+inline void write_all(int fd, void const* data, size_t bytes) {
+  auto from = static_cast<unsigned char const*>(data);
+  while (bytes != 0) {
+    ssize_t written = ::write(fd, from, bytes);
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "write");
+    }
+    from += written;
+    bytes -= static_cast<size_t>(written);
+  }
+}
+
+// false if the file ends first
+inline bool read_all(int fd, void* data, size_t bytes) {
+  auto to = static_cast<unsigned char*>(data);
+  while (bytes != 0) {
+    ssize_t got = ::read(fd, to, bytes);
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      throw std::system_error(errno, std::generic_category(), "read");
+    }
+    if (got == 0) {
+      return false;
+    }
+    to += got;
+    bytes -= static_cast<size_t>(got);
+  }
+  return true;
+}
+#endif
+
+template <typename Allocator,
+          bool = std::is_empty_v<Allocator> && !std::is_final_v<Allocator>>
+struct allocator_holder {
+  explicit allocator_holder(Allocator const& alloc) : alloc_(alloc) {}
+
+  Allocator& allocator() {
+    return alloc_;
+  }
+
+  Allocator const& allocator() const {
+    return alloc_;
+  }
+
+private:
+  Allocator alloc_;
+};
+
+template <typename Allocator>
+struct allocator_holder<Allocator, true> : private Allocator {
+  explicit allocator_holder(Allocator const& alloc) : Allocator(alloc) {}
+
+  Allocator& allocator() {
+    return *this;
+  }
+
+  Allocator const& allocator() const {
+    return *this;
+  }
+};
+
+} // namespace detail
+
+} // namespace socow
+
+template <typename Vector>
+struct socow_slice;
+
+template <typename Vector>
+struct frozen_socow_vector;
+
+// Allocator only provides the big storage blocks. Blocks are shared between
+// copies only while their allocators compare equal, so every owner is able to
+// free the block and a copy never outlives the memory resource it came from.
+// data() is aligned to Alignment both in the small and in the big storage.
+// Stats is told about allocations, detaches, copies and the like (see
+// socow::stat); the default socow::no_stats costs nothing. The default
+// SMALL_SIZE makes the vector 64 bytes (see socow::small_size_for) with the
+// default Alignment and a stateless allocator, unless a single T is too big.
+template <typename T, size_t SMALL_SIZE = socow::small_size_for<T>,
+          typename RefCount = socow::nonatomic_refcount,
+          typename Allocator = std::allocator<T>,
+          typename Growth = socow::growth_2x,
+          size_t Alignment = alignof(T),
+          typename Stats = socow::no_stats>
+struct socow_vector : private socow::detail::allocator_holder<Allocator> {
+  using value_type = T;
   using iterator = T*;
   using const_iterator = T const*;
+  using allocator_type = Allocator;
+
+  template <typename OtherRefCount>
+  using with_refcount = socow_vector<T, SMALL_SIZE, OtherRefCount, Allocator,
+                                     Growth, Alignment, Stats>;
+
+  static_assert(std::is_same_v<typename Allocator::value_type, T>,
+                "Allocator::value_type must be T");
+  static_assert(Alignment >= alignof(T) && (Alignment & (Alignment - 1)) == 0,
+                "Alignment must be a power of two not less than alignof(T)");
 
-  socow_vector() : size_(0), is_small(true) {}
+  socow_vector() : socow_vector(Allocator()) {}
+
+  explicit socow_vector(Allocator const& alloc)
+      : socow::detail::allocator_holder<Allocator>(alloc), size_and_flag_(0) {}
+
+  socow_vector(socow_vector const& other)
+      : socow_vector(other, alloc_traits::select_on_container_copy_construction(
+                                other.allocator())) {}
+
+  socow_vector(socow_vector const& other, Allocator const& alloc)
+      : socow::detail::allocator_holder<Allocator>(alloc),
+        size_and_flag_(other.size_and_flag_) {
+    if (other.is_small()) {
+      copy_from_begin(other.small_storage, small_storage, other.size());
+    } else if (same_allocator(other)) {
+      big_storage = other.big_storage;
+      big_storage->counter_.inc();
+    } else {
+      big_storage = make_new_storage_with_fixed_capacity(other.capacity());
+      try {
+        copy_from_begin(other.big_storage->data_, big_storage->data_, size());
+      } catch (...) {
+        free_storage(big_storage);
+        throw;
+      }
+    }
+  }
 
-  socow_vector(socow_vector const& other) : size_(other.size_), is_small(other.is_small) {
-    if (other.is_small) {
-      copy_from_begin(other.small_storage, small_storage, other.size_);
+  socow_vector(socow_vector&& other) noexcept(
+      std::is_nothrow_move_constructible_v<T>)
+      : socow::detail::allocator_holder<Allocator>(other.allocator()),
+        size_and_flag_(other.size_and_flag_) {
+    if (other.is_small()) {
+      move_from_begin(other.small_storage, small_storage, other.size());
+      remove(other.my_begin(), other.my_end());
     } else {
       big_storage = other.big_storage;
-      big_storage->counter_++;
     }
+    other.size_and_flag_ = 0;
+  }
+
+  socow_vector(socow_vector&& other, Allocator const& alloc)
+      : socow::detail::allocator_holder<Allocator>(alloc),
+        size_and_flag_(other.size_and_flag_) {
+    if (other.is_small()) {
+      move_from_begin(other.small_storage, small_storage, other.size());
+      remove(other.my_begin(), other.my_end());
+    } else if (same_allocator(other)) {
+      big_storage = other.big_storage;
+    } else {
+      big_storage = make_new_storage_with_fixed_capacity(other.capacity());
+      try {
+        transfer_from_begin(other.big_storage->data_, big_storage->data_,
+                            size(), !other.is_shared());
+      } catch (...) {
+        free_storage(big_storage);
+        throw;
+      }
+      other.release();
+    }
+    other.size_and_flag_ = 0;
   }
 
   socow_vector& operator=(socow_vector const& other) {
     if (&other != this) {
-      socow_vector(other).swap(*this);
+      if constexpr (alloc_traits::propagate_on_container_copy_assignment::value) {
+        socow_vector tmp(other, other.allocator());
+        swap_elements(tmp);
+        swap_allocators(tmp);
+      } else {
+        socow_vector(other, allocator()).swap_elements(*this);
+      }
     }
     return *this;
   }
 
-  ~socow_vector() {
-    if (is_small) {
-      remove(my_begin(), my_end());
-      return;
-    }
-    if (big_storage->dec()) {
-      remove(my_begin(), my_end());
-      operator delete(big_storage);
+  socow_vector& operator=(socow_vector&& other) noexcept(
+      (alloc_traits::propagate_on_container_move_assignment::value ||
+       alloc_traits::is_always_equal::value) &&
+      std::is_nothrow_move_constructible_v<T> &&
+      std::is_nothrow_swappable_v<T>) {
+    if (&other != this) {
+      if constexpr (alloc_traits::propagate_on_container_move_assignment::value) {
+        socow_vector tmp(std::move(other));
+        swap_elements(tmp);
+        swap_allocators(tmp);
+      } else {
+        socow_vector(std::move(other), allocator()).swap_elements(*this);
+      }
     }
+    return *this;
+  }
+
+  allocator_type get_allocator() const {
+    return allocator();
+  }
+
+  ~socow_vector() {
+    release();
   }
 
   T& operator[](size_t i) {
@@ -52,8 +608,38 @@ struct socow_vector {
     return begin();
   }
 
+  // Read-only access under a distinct name, for non-const vectors: unlike
+  // the non-const accessors these never copy a shared storage.
+  T const* cdata() const {
+    return begin();
+  }
+
+  T const& cfront() const {
+    return *begin();
+  }
+
+  T const& cback() const {
+    return *(end() - 1);
+  }
+
+  // true while another vector refers to the same storage, so that the next
+  // non-const access would copy it
+  bool is_shared() const {
+    return !is_small() && big_storage->is_not_unique();
+  }
+
+  // Makes the storage unique now, so that the non-const accessors used
+  // afterwards find nothing to copy. Pointers and references obtained
+  // through them stay valid until the vector is copied from or changes
+  // its size.
+  void detach() {
+    if (is_shared()) {
+      expand_storage(capacity());
+    }
+  }
+
   size_t size() const {
-    return size_;
+    return size_and_flag_ & ~big_flag;
   }
 
   T& front() {
@@ -73,86 +659,265 @@ struct socow_vector {
   }
 
   void push_back(T const& element) {
-    if (size_ == capacity()) {
-      storage* tmp = copy_storage_with_fixed_capacity(capacity() * 2);
-      try {
-        new(tmp->data_ + size_) T(element);
-      } catch (...) {
-        remove(tmp->data_, tmp->data_ + size_);
-        operator delete(tmp);
-        throw;
+    emplace_back(element);
+  }
+
+  void push_back(T&& element) {
+    emplace_back(std::move(element));
+  }
+
+  template <typename... Args>
+  T& emplace_back(Args&&... args) {
+    if (size() == capacity() || is_shared()) {
+      size_t new_capacity = size() == capacity()
+                                ? Growth::next_capacity(capacity(), size() + 1)
+                                : capacity();
+      if constexpr (reallocatable) {
+        if (!is_small() && !big_storage->is_not_unique()) {
+          // args may refer to the elements realloc is about to move
+          T element(std::forward<Args>(args)...);
+          reallocate_storage(new_capacity);
+          T* data = my_begin();
+          new(data + size()) T(std::move(element));
+          size_and_flag_++;
+          return data[size() - 1];
+        }
       }
-      this->~socow_vector();
-      big_storage = tmp;
-      is_small = false;
-    } else {
-      new(begin() + size_) T(element);
+      return *rebuild_with(new_capacity, size(), 0, 1, [&](T* to, size_t) {
+        new(to) T(std::forward<Args>(args)...);
+      });
     }
-    size_++;
+    T* data = my_begin();
+    new(data + size()) T(std::forward<Args>(args)...);
+    size_and_flag_++;
+    return data[size() - 1];
   }
 
   void pop_back() {
-    (end() - 1)->~T();
-    size_--;
+    if (is_shared()) {
+      rebuild_with(capacity(), size() - 1, 1, 0, [](T*, size_t) {});
+      return;
+    }
+    (my_end() - 1)->~T();
+    size_and_flag_--;
   }
 
   bool empty() const {
-    return size_ == 0;
+    return size() == 0;
   }
 
   size_t capacity() const {
-    return is_small ? SMALL_SIZE : big_storage->capacity_;
+    return is_small() ? SMALL_SIZE : big_storage->capacity();
   }
 
   void reserve(size_t new_capacity) {
-    if ((!is_small && big_storage->is_not_unique()) || new_capacity > capacity()) {
+    if (is_shared() || new_capacity > capacity()) {
       expand_storage(std::max<size_t>(new_capacity, capacity()));
     }
   }
 
   void shrink_to_fit() {
-    if (is_small) return;
-    if (size_ <= SMALL_SIZE) {
+    if (is_small()) return;
+    if (size() <= SMALL_SIZE) {
       storage* tmp = big_storage;
+      bool unique = !tmp->is_not_unique();
       big_storage = nullptr;
       try {
-        copy_from_begin(tmp->data_, small_storage, size_);
+        transfer_from_begin(tmp->data_, small_storage, size(), unique);
       } catch (...) {
         big_storage = tmp;
         throw;
       }
       if (tmp->dec()) {
-        remove(tmp->data_, tmp->data_ + size_);
-        operator delete(tmp);
+        remove(tmp->data_, tmp->data_ + size());
+        free_storage(tmp);
+      }
+      if (!unique) {
+        record_detach(size());
       }
-      is_small = true;
-    } else if (size_ != capacity()) {
-      expand_storage(size_);
+      Stats::record(socow::stat::big_to_small);
+      set_small(true);
+    } else if (!fits_tightly()) {
+      expand_storage(size());
     }
   }
 
   void clear() {
-    erase(begin(), end());
+    if (is_shared()) {
+      release();
+      size_and_flag_ = 0;
+      Stats::record(socow::stat::big_to_small);
+      return;
+    }
+    remove(my_begin(), my_end());
+    set_size(0);
+  }
+
+  // Each of these unshares the storage at most once: a shared storage is
+  // copied only for the elements that stay, straight into a storage that
+  // has room for the new ones.
+  void resize(size_t n) {
+    resize_with(n, [](T* to, size_t) { new(to) T(); });
+  }
+
+  void resize(size_t n, T const& value) {
+    if constexpr (reallocatable) {
+      // realloc may move the element value refers to
+      T copy(value);
+      resize_with(n, [&copy](T* to, size_t) { new(to) T(copy); });
+    } else {
+      resize_with(n, [&value](T* to, size_t) { new(to) T(value); });
+    }
+  }
+
+  // New elements are default-initialized, so trivial ones are left
+  // uninitialized, ready to be filled through data() by read() and the like.
+  void resize_default_init(size_t n) {
+    resize_with(n, [](T* to, size_t) { new(to) T; });
+  }
+
+  void resize_for_overwrite(size_t n) {
+    resize_default_init(n);
+  }
+
+  void assign(size_t n, T const& value) {
+    if (is_shared() || n > capacity()) {
+      size_t new_capacity =
+          n > capacity() ? Growth::next_capacity(capacity(), n) : capacity();
+      rebuild_with(new_capacity, 0, size(), n,
+                   [&value](T* to, size_t) { new(to) T(value); });
+      return;
+    }
+    // value may be one of the elements, so the excess goes last
+    T* data = my_begin();
+    size_t old_size = size();
+    std::fill(data, data + std::min(n, old_size), value);
+    if (n > old_size) {
+      construct_at_end(n, [&value](T* to, size_t) { new(to) T(value); });
+    } else {
+      remove(data + n, data + old_size);
+      set_size(n);
+    }
   }
 
   void swap(socow_vector& other) {
-    if (size_ > other.size_ || (!is_small && other.is_small)) {
-      other.swap(*this);
+    if (is_small() != other.is_small()) {
+      Stats::record(socow::stat::small_big_swaps);
+    } else {
+      Stats::record(is_small() ? socow::stat::small_small_swaps
+                               : socow::stat::big_big_swaps);
+    }
+    swap_elements(other);
+    if constexpr (alloc_traits::propagate_on_container_swap::value) {
+      swap_allocators(other);
+    }
+  }
+
+private:
+  template <typename, size_t, typename, typename, typename, size_t, typename>
+  friend struct socow_vector;
+
+  // Takes the elements of a vector that differs only in its RefCount. A
+  // unique big storage is kept, with its reference count replaced in place;
+  // the headers only differ in the counter's type.
+  template <typename Other>
+  socow_vector(socow::detail::adopt_t, Other&& other)
+      : socow::detail::allocator_holder<Allocator>(other.allocator()),
+        size_and_flag_(other.size_and_flag_) {
+    using other_storage = typename Other::storage;
+    static_assert(sizeof(other_storage) == sizeof(storage) &&
+                  alignof(other_storage) == alignof(storage));
+    if (other.is_small()) {
+      move_from_begin(other.small_storage, small_storage, other.size());
+      other.clear();
+    } else if (!other.big_storage->is_not_unique()) {
+      size_t capacity = other.big_storage->capacity();
+      other.big_storage->~other_storage();
+      big_storage = new (static_cast<void*>(other.big_storage))
+          storage(capacity);
+      other.size_and_flag_ = 0;
+    } else {
+      big_storage = make_new_storage_with_fixed_capacity(other.capacity());
+      try {
+        copy_from_begin(other.big_storage->data_, big_storage->data_, size());
+      } catch (...) {
+        free_storage(big_storage);
+        throw;
+      }
+    }
+  }
+
+  socow::binary_header make_binary_header() const {
+    socow::binary_header header{};
+    std::memcpy(header.magic, socow::binary_header::magic_value,
+                sizeof(header.magic));
+    header.little_endian = socow::detail::is_little_endian();
+    header.version = socow::binary_header::current_version;
+    header.element_size = sizeof(T);
+    header.count = size();
+    return header;
+  }
+
+  // the element count of a header this build can read
+  static size_t check_binary_header(socow::binary_header const& header) {
+    if (std::memcmp(header.magic, socow::binary_header::magic_value,
+                    sizeof(header.magic)) != 0) {
+      throw std::runtime_error("socow_vector: not a serialized vector");
+    }
+    if (header.little_endian != socow::detail::is_little_endian()) {
+      throw std::runtime_error("socow_vector: written with another byte order");
+    }
+    if (header.version != socow::binary_header::current_version) {
+      throw std::runtime_error("socow_vector: unknown format version");
+    }
+    if (header.element_size != sizeof(T)) {
+      throw std::runtime_error("socow_vector: element size mismatch");
+    }
+    if (header.count > (~size_t(0) >> 1) / sizeof(T)) {
+      throw std::runtime_error("socow_vector: too many elements");
+    }
+    return header.count;
+  }
+
+  // Gives an empty vector count elements of trivially copyable T to be
+  // filled in by the caller.
+  T* uninitialized_elements(size_t count) {
+    if (count > SMALL_SIZE) {
+      big_storage = make_new_storage_with_fixed_capacity(count);
+      size_and_flag_ = big_flag | count;
+      return big_storage->data_;
+    }
+    size_and_flag_ = count;
+    return small_storage;
+  }
+
+  void swap_elements(socow_vector& other) {
+    if (size() > other.size() || (!is_small() && other.is_small())) {
+      other.swap_elements(*this);
       return;
     }
-    if (is_small && other.is_small) {
-      for (size_t i = 0; i < size_; ++i) {
-        std::swap(small_storage[i], other.small_storage[i]);
+    if (is_small() && other.is_small()) {
+      if constexpr (std::is_trivially_copyable_v<T>) {
+        // only the live elements: size() <= other.size() here
+        unsigned char tmp[sizeof(small_storage)];
+        std::memcpy(tmp, small_storage, size() * sizeof(T));
+        std::memcpy(small_storage, other.small_storage,
+                    other.size() * sizeof(T));
+        std::memcpy(other.small_storage, tmp, size() * sizeof(T));
+      } else {
+        for (size_t i = 0; i < size(); ++i) {
+          std::swap(small_storage[i], other.small_storage[i]);
+        }
+        move_in_range(other.small_storage, small_storage, size(), other.size());
+        remove(other.my_begin() + size(), other.my_end());
       }
-      copy_in_range(other.small_storage, small_storage, size_, other.size_);
-      remove(other.my_begin() + size_, other.my_end());
-    } else if (!is_small && !other.is_small) {
+    } else if (!is_small() && !other.is_small()) {
       std::swap(big_storage, other.big_storage);
     } else {
       storage* tmp = other.big_storage;
       other.big_storage = nullptr;
       try {
-        copy_from_begin(small_storage, other.small_storage, size_);
+        move_from_begin(small_storage, other.small_storage, size());
       } catch (...) {
         other.big_storage = tmp;
         throw;
@@ -160,37 +925,254 @@ struct socow_vector {
       remove(my_begin(), my_end());
       big_storage = tmp;
     }
-    std::swap(size_, other.size_);
-    std::swap(is_small, other.is_small);
+    std::swap(size_and_flag_, other.size_and_flag_);
+  }
+
+  void swap_allocators(socow_vector& other) {
+    using std::swap;
+    swap(allocator(), other.allocator());
   }
 
+public:
   iterator begin() {
-    if (is_small) return small_storage;
-    if (!is_small && big_storage->is_not_unique()) {
+    if (is_small()) return small_storage;
+    if (big_storage->is_not_unique()) {
       expand_storage(capacity());
     }
     return big_storage->data_;
   }
 
   iterator end() {
-    return begin() + size_;
+    return begin() + size();
   }
 
   const_iterator begin() const {
-    return is_small ? small_storage : big_storage->data_;
+    return is_small() ? small_storage : big_storage->data_;
   }
 
   const_iterator end() const {
-    return begin() + size_;
+    return begin() + size();
   }
 
-  iterator insert(const_iterator pos, T const& t) {
-    ptrdiff_t diff = pos - my_begin();
-    push_back(t);
-    for (size_t i = size_ - 1; i > diff; --i) {
-      std::swap(*(my_begin() + i), *(my_begin() + i - 1));
-    }
-    return my_begin() + diff;
+  const_iterator cbegin() const {
+    return begin();
+  }
+
+  const_iterator cend() const {
+    return end();
+  }
+
+#if defined(SOCOW_HAS_SPAN)
+  std::span<T const> view() const {
+    return {begin(), size()};
+  }
+
+  // detaches once; elements are then written through the span without the
+  // sharing check every non-const accessor does
+  std::span<T> mutable_span() {
+    return {begin(), size()};
+  }
+#endif
+
+#if defined(SOCOW_HAS_POSIX)
+  // The elements stored in the file at path, mapped into memory instead of
+  // read. Every copy shares the read-only mapping, and the first mutation
+  // copies the elements into a heap storage, as if the mapping were shared
+  // with another vector. The file must not shrink while it is mapped.
+  static socow_vector map_file(char const* path,
+                               Allocator const& alloc = Allocator())
+    requires std::is_trivially_copyable_v<T>
+  {
+    socow::detail::file_descriptor file{::open(path, O_RDONLY | O_CLOEXEC)};
+    struct stat info;
+    if (file.fd < 0 || ::fstat(file.fd, &info) != 0) {
+      throw std::system_error(errno, std::generic_category(), path);
+    }
+    size_t count = static_cast<size_t>(info.st_size) / sizeof(T);
+    if (count == 0) {
+      return socow_vector(alloc);
+    }
+    void* data =
+        socow::detail::map_after_header(file.fd, buffer_offset(),
+                                         buffer_alignment(), count * sizeof(T));
+    return from_buffer(
+        static_cast<unsigned char*>(data) - buffer_offset(), count,
+        [](void* buffer, size_t bytes) {
+          socow::detail::unmap_after_header(
+              static_cast<unsigned char*>(buffer) + buffer_offset(),
+              buffer_offset(), bytes - buffer_offset());
+        },
+        alloc);
+  }
+#endif
+
+  // Where from_buffer() expects the elements in the buffer; the bytes in
+  // front of them are left for the storage header.
+  static constexpr size_t buffer_offset() {
+    return external_prefix_bytes + sizeof(storage);
+  }
+
+  static constexpr size_t buffer_alignment() {
+    return alignof(storage);
+  }
+
+  // Adopts count elements placed at buffer + buffer_offset() as the big
+  // storage, without copying them. buffer must be aligned to
+  // buffer_alignment(). The vector and its copies only read the buffer,
+  // the first mutation copies the elements to a heap storage, and the last
+  // of them calls release(buffer, buffer_offset() + count * sizeof(T)), if
+  // given, once it is done with the buffer.
+  static socow_vector from_buffer(void* buffer, size_t count,
+                                  void (*release)(void*, size_t) = nullptr,
+                                  Allocator const& alloc = Allocator())
+    requires std::is_trivially_copyable_v<T>
+  {
+    auto bytes = static_cast<unsigned char*>(buffer);
+    new (bytes) external_prefix{release};
+    socow_vector ans(alloc);
+    ans.big_storage = new (bytes + external_prefix_bytes)
+        storage(count | external_flag);
+    ans.size_and_flag_ = big_flag | count;
+    return ans;
+  }
+
+  // Writes a binary_header and then all the elements with one write.
+  void write_to(std::ostream& out) const
+    requires std::is_trivially_copyable_v<T>
+  {
+    socow::binary_header header = make_binary_header();
+    out.write(reinterpret_cast<char const*>(&header), sizeof(header));
+    out.write(reinterpret_cast<char const*>(cdata()),
+              static_cast<std::streamsize>(size() * sizeof(T)));
+  }
+
+  // Reads what write_to() wrote straight into the new vector's storage.
+  // Throws std::runtime_error on a foreign or truncated input.
+  static socow_vector read_from(std::istream& in,
+                                Allocator const& alloc = Allocator())
+    requires std::is_trivially_copyable_v<T>
+  {
+    socow::binary_header header;
+    if (!in.read(reinterpret_cast<char*>(&header), sizeof(header))) {
+      throw std::runtime_error("socow_vector: truncated input");
+    }
+    socow_vector ans(alloc);
+    T* data = ans.uninitialized_elements(check_binary_header(header));
+    if (!in.read(reinterpret_cast<char*>(data),
+                 static_cast<std::streamsize>(ans.size() * sizeof(T)))) {
+      throw std::runtime_error("socow_vector: truncated input");
+    }
+    return ans;
+  }
+
+#if defined(SOCOW_HAS_POSIX)
+  void write_to(int fd) const
+    requires std::is_trivially_copyable_v<T>
+  {
+    socow::binary_header header = make_binary_header();
+    socow::detail::write_all(fd, &header, sizeof(header));
+    socow::detail::write_all(fd, cdata(), size() * sizeof(T));
+  }
+
+  static socow_vector read_from(int fd, Allocator const& alloc = Allocator())
+    requires std::is_trivially_copyable_v<T>
+  {
+    socow::binary_header header;
+    if (!socow::detail::read_all(fd, &header, sizeof(header))) {
+      throw std::runtime_error("socow_vector: truncated input");
+    }
+    socow_vector ans(alloc);
+    T* data = ans.uninitialized_elements(check_binary_header(header));
+    if (!socow::detail::read_all(fd, data, ans.size() * sizeof(T))) {
+      throw std::runtime_error("socow_vector: truncated input");
+    }
+    return ans;
+  }
+#endif
+
+  // A read-only snapshot that may be shared between threads, see
+  // frozen_socow_vector. Freezing an rvalue with a storage of its own keeps
+  // that storage; otherwise the elements are copied, since the snapshot's
+  // owners must not touch this vector's reference count.
+  frozen_socow_vector<socow_vector> freeze() && {
+    using shared_type = with_refcount<socow::atomic_refcount>;
+    return frozen_socow_vector<socow_vector>(
+        shared_type(socow::detail::adopt_t(), std::move(*this)));
+  }
+
+  frozen_socow_vector<socow_vector> freeze() const& {
+    return socow_vector(*this).freeze();
+  }
+
+  // [offset, offset + count) without copying a big storage, see socow_slice
+  socow_slice<socow_vector> slice(size_t offset, size_t count) const {
+    return {*this, offset, count};
+  }
+
+  iterator insert(const_iterator pos, T const& t) {
+    return emplace(pos, t);
+  }
+
+  iterator insert(const_iterator pos, T&& t) {
+    return emplace(pos, std::move(t));
+  }
+
+  iterator insert(const_iterator pos, size_t count, T const& t) {
+    size_t index = pos - my_begin();
+    if constexpr (nothrow_relocatable) {
+      if (fits_in_place(count)) {
+        // t may be one of the elements about to be shifted
+        T tmp(t);
+        return insert_with(index, count,
+                           [&tmp](T* to, size_t) { new(to) T(tmp); });
+      }
+    }
+    return insert_with(index, count, [&t](T* to, size_t) { new(to) T(t); });
+  }
+
+  template <typename InputIt,
+            typename = typename std::iterator_traits<InputIt>::iterator_category>
+  iterator insert(const_iterator pos, InputIt first, InputIt last) {
+    size_t index = pos - my_begin();
+    using category = typename std::iterator_traits<InputIt>::iterator_category;
+    if constexpr (std::is_base_of_v<std::forward_iterator_tag, category>) {
+      size_t count = std::distance(first, last);
+      return insert_with(index, count, [&first](T* to, size_t) {
+        new(to) T(*first);
+        ++first;
+      });
+    } else {
+      // the whole range is read first, so that a throw while reading it
+      // leaves the vector as it was
+      socow_vector tail(allocator());
+      for (; first != last; ++first) {
+        tail.emplace_back(*first);
+      }
+      T* from = tail.my_begin();
+      return insert_with(index, tail.size(), [from](T* to, size_t k) {
+        new(to) T(std::move(from[k]));
+      });
+    }
+  }
+
+  iterator insert(const_iterator pos, std::initializer_list<T> list) {
+    return insert(pos, list.begin(), list.end());
+  }
+
+  template <typename... Args>
+  iterator emplace(const_iterator pos, Args&&... args) {
+    size_t index = pos - my_begin();
+    if constexpr (nothrow_relocatable) {
+      if (fits_in_place(1)) {
+        T tmp(std::forward<Args>(args)...);
+        return insert_with(index, 1, [&tmp](T* to, size_t) {
+          new(to) T(std::move(tmp));
+        });
+      }
+    }
+    return insert_with(index, 1, [&](T* to, size_t) {
+      new(to) T(std::forward<Args>(args)...);
+    });
   }
 
   iterator erase(const_iterator pos) {
@@ -200,25 +1182,68 @@ struct socow_vector {
   iterator erase(const_iterator first, const_iterator last) {
     ptrdiff_t count = last - first;
     ptrdiff_t start = first - my_begin();
-    for (size_t i = start; i < size_ - count; i++) {
-      std::swap(operator[](i), operator[](i + count));
+    if (is_shared()) {
+      return rebuild_with(capacity(), start, count, 0, [](T*, size_t) {});
     }
-    for (size_t i = 0; i < count; ++i) {
-      pop_back();
+    T* data = my_begin();
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      std::memmove(data + start, data + start + count,
+                   (size() - start - count) * sizeof(T));
+    } else {
+      std::move(data + start + count, data + size(), data + start);
+      remove(data + size() - count, data + size());
     }
-    return begin() + start;
+    size_and_flag_ -= count;
+    return data + start;
   }
 
 private:
+  using alloc_traits = std::allocator_traits<Allocator>;
+  using socow::detail::allocator_holder<Allocator>::allocator;
+
+  // elements that can be moved to another address without a chance of
+  // failure, which lets insert shift the tail before building new elements
+  static constexpr bool nothrow_relocatable =
+      std::is_trivially_copyable_v<T> || std::is_nothrow_move_constructible_v<T>;
+
   iterator my_begin() {
-    return is_small ? small_storage : big_storage->data_;
+    return is_small() ? small_storage : big_storage->data_;
   }
 
   iterator my_end() {
-    return my_begin() + size_;
+    return my_begin() + size();
+  }
+
+  bool fits_in_place(size_t count) const {
+    return !is_shared() && size() + count <= capacity();
+  }
+
+  bool same_allocator(socow_vector const& other) const {
+    if constexpr (alloc_traits::is_always_equal::value) {
+      return true;
+    } else {
+      return allocator() == other.allocator();
+    }
   }
 
   void copy_in_range(T const* from, T* to, size_t start, size_t end) {
+    if (start < end) {
+      Stats::record(socow::stat::elements_copied, end - start);
+    }
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      if (start < end) {
+        std::memcpy(to + start, from + start, (end - start) * sizeof(T));
+      }
+      return;
+    }
+    if constexpr (socow::parallel_copy<T>::threshold != 0) {
+      if (end > start && end - start >= socow::parallel_copy<T>::threshold) {
+        socow::detail::parallel_copy_construct(
+            from + start, to + start, end - start,
+            socow::parallel_copy<T>::threads());
+        return;
+      }
+    }
     size_t i = start;
     try {
       while (i < end) {
@@ -226,7 +1251,7 @@ private:
         ++i;
       }
     } catch (...) {
-      remove(to, to + i);
+      remove(to + start, to + i);
       throw;
     }
   }
@@ -235,7 +1260,213 @@ private:
     copy_in_range(from, to, 0, count);
   }
 
+  void move_in_range(T* from, T* to, size_t start, size_t end) {
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      if (start < end) {
+        std::memcpy(to + start, from + start, (end - start) * sizeof(T));
+      }
+      return;
+    }
+    size_t i = start;
+    try {
+      while (i < end) {
+        new(to + i) T(std::move_if_noexcept(from[i]));
+        ++i;
+      }
+    } catch (...) {
+      remove(to + start, to + i);
+      throw;
+    }
+  }
+
+  void move_from_begin(T* from, T* to, size_t count) {
+    move_in_range(from, to, 0, count);
+  }
+
+  // elements of a uniquely owned buffer may be moved out, shared ones are
+  // still visible to other owners and have to be copied
+  void transfer_from_begin(T* from, T* to, size_t count, bool unique) {
+    if constexpr (std::is_copy_constructible_v<T>) {
+      if (!unique) {
+        copy_from_begin(from, to, count);
+        return;
+      }
+    }
+    move_from_begin(from, to, count);
+  }
+
+  // moves count elements to possibly overlapping raw memory, the source is
+  // left raw; only for nothrow_relocatable types
+  static void relocate(T* from, T* to, size_t count) {
+    if constexpr (std::is_trivially_copyable_v<T>) {
+      if (count != 0) {
+        std::memmove(to, from, count * sizeof(T));
+      }
+    } else if (to > from) {
+      for (size_t i = count; i-- > 0;) {
+        new(to + i) T(std::move(from[i]));
+        from[i].~T();
+      }
+    } else {
+      for (size_t i = 0; i < count; ++i) {
+        new(to + i) T(std::move(from[i]));
+        from[i].~T();
+      }
+    }
+  }
+
+  // Inserts count elements at index, construct(to, k) builds the k-th of
+  // them. Reallocates at most once; when a new buffer is needed the new
+  // elements are built before the old ones are moved, so construct may read
+  // the current elements.
+  template <typename Construct>
+  iterator insert_with(size_t index, size_t count, Construct construct) {
+    if (count == 0) {
+      return begin() + index;
+    }
+    if (fits_in_place(count)) {
+      T* data = my_begin();
+      size_t k = 0;
+      if constexpr (nothrow_relocatable) {
+        relocate(data + index, data + index + count, size() - index);
+        try {
+          for (; k != count; ++k) {
+            construct(data + index + k, k);
+          }
+        } catch (...) {
+          remove(data + index, data + index + k);
+          relocate(data + index + count, data + index, size() - index);
+          throw;
+        }
+      } else {
+        T* end = data + size();
+        try {
+          for (; k != count; ++k) {
+            construct(end + k, k);
+          }
+        } catch (...) {
+          remove(end, end + k);
+          throw;
+        }
+        // A move that throws here may leave the elements partly rotated;
+        // like std::vector, only the basic guarantee is kept: the size is
+        // restored and every element is still alive.
+        try {
+          std::rotate(data + index, end, end + count);
+        } catch (...) {
+          remove(end, end + count);
+          throw;
+        }
+      }
+      size_and_flag_ += count;
+      return data + index;
+    }
+
+    size_t new_capacity = capacity();
+    if (size() + count > new_capacity) {
+      new_capacity = Growth::next_capacity(new_capacity, size() + count);
+    }
+    return rebuild_with(new_capacity, index, 0, count, construct);
+  }
+
+  // Moves to a new unique buffer with the edit already applied: the old
+  // elements [index, index + erased) are skipped and inserted slots built by
+  // construct take their place, so a shared buffer is copied only once and
+  // only for the surviving elements. New elements are built before the old
+  // ones are moved, so construct may read the current elements.
+  template <typename Construct>
+  iterator rebuild_with(size_t new_capacity, size_t index, size_t erased,
+                        size_t inserted, Construct construct) {
+    storage* tmp = make_new_storage_with_fixed_capacity(new_capacity);
+    T* to = tmp->data_;
+    size_t k = 0;
+    try {
+      for (; k != inserted; ++k) {
+        construct(to + index + k, k);
+      }
+    } catch (...) {
+      remove(to + index, to + index + k);
+      free_storage(tmp);
+      throw;
+    }
+    T* from = my_begin();
+    size_t tail = size() - index - erased;
+    bool unique = !is_shared();
+    try {
+      transfer_from_begin(from, to, index, unique);
+      try {
+        transfer_from_begin(from + index + erased, to + index + inserted, tail,
+                            unique);
+      } catch (...) {
+        remove(to, to + index);
+        throw;
+      }
+    } catch (...) {
+      remove(to + index, to + index + inserted);
+      free_storage(tmp);
+      throw;
+    }
+    record_detach_or_growth(size() - erased);
+    release();
+    big_storage = tmp;
+    size_and_flag_ = big_flag | (size() - erased + inserted);
+    return to + index;
+  }
+
+  // Grows or shrinks to n elements, the new ones built by construct(to, k).
+  // Like the other edits, a shared storage is left through rebuild_with().
+  template <typename Construct>
+  void resize_with(size_t n, Construct construct) {
+    size_t old_size = size();
+    if (n <= old_size) {
+      if (n == old_size) {
+        return;
+      }
+      if (is_shared()) {
+        rebuild_with(capacity(), n, old_size - n, 0, [](T*, size_t) {});
+        return;
+      }
+      remove(my_begin() + n, my_end());
+      set_size(n);
+      return;
+    }
+    if (n > capacity() || is_shared()) {
+      size_t new_capacity =
+          n > capacity() ? Growth::next_capacity(capacity(), n) : capacity();
+      if constexpr (reallocatable) {
+        if (!is_small() && !big_storage->is_not_unique()) {
+          reallocate_storage(new_capacity);
+          construct_at_end(n, construct);
+          return;
+        }
+      }
+      rebuild_with(new_capacity, old_size, 0, n - old_size, construct);
+      return;
+    }
+    construct_at_end(n, construct);
+  }
+
+  // builds elements [size(), n) in place, there must be room for them
+  template <typename Construct>
+  void construct_at_end(size_t n, Construct construct) {
+    T* data = my_begin();
+    size_t old_size = size();
+    size_t i = old_size;
+    try {
+      for (; i != n; ++i) {
+        construct(data + i, i - old_size);
+      }
+    } catch (...) {
+      remove(data + old_size, data + i);
+      throw;
+    }
+    set_size(n);
+  }
+
   void remove(T* start, T* end) {
+    if constexpr (std::is_trivially_destructible_v<T>) {
+      return;
+    }
     if (start != nullptr) {
       ptrdiff_t count = end - start;
       for (ptrdiff_t i = count - 1; i >= 0; --i) {
@@ -244,53 +1475,458 @@ private:
     }
   }
 
+  // drops the elements and the reference to the big storage, leaving the
+  // allocator in place
+  void release() {
+    if (is_small()) {
+      remove(my_begin(), my_end());
+      return;
+    }
+    if (big_storage->dec()) {
+      remove(my_begin(), my_end());
+      free_storage(big_storage);
+    }
+  }
+
   void expand_storage(size_t new_capacity) {
-    storage* tmp = copy_storage_with_fixed_capacity(new_capacity);
-    this->~socow_vector();
+    if constexpr (reallocatable) {
+      if (!is_small() && !big_storage->is_not_unique()) {
+        reallocate_storage(new_capacity);
+        return;
+      }
+    }
+    storage* tmp = relocate_storage_with_fixed_capacity(new_capacity);
+    record_detach_or_growth(size());
+    release();
     big_storage = tmp;
-    is_small = false;
+    set_small(false);
+  }
+
+  // called when copied elements are about to leave for a new big storage
+  void record_detach_or_growth(size_t copied) const {
+    if (is_small()) {
+      Stats::record(socow::stat::small_to_big);
+    } else if (big_storage->is_not_unique()) {
+      record_detach(copied);
+    }
+  }
+
+  static void record_detach(size_t copied) {
+    Stats::record(socow::stat::detaches);
+    Stats::record(socow::stat::detached_bytes, copied * sizeof(T));
   }
 
+  // A storage adopted by from_buffer() (or map_file()) has external_flag
+  // set in capacity_ and an external_prefix in front of it. Its elements
+  // are never written to, so it never counts as unique.
   struct storage {
-    size_t counter_;
+    RefCount counter_;
     size_t capacity_;
-    T data_[0];
+    alignas(Alignment) T data_[0];
     
     explicit storage(size_t n) : counter_(1), capacity_(n) {}
 
     bool dec() {
-      counter_--;
-      return counter_ == 0;
+      return counter_.dec();
+    }
+
+    size_t capacity() const {
+      return capacity_ & ~external_flag;
+    }
+
+    bool is_external() const {
+      if constexpr (std::is_trivially_copyable_v<T>) {
+        return (capacity_ & external_flag) != 0;
+      }
+      return false;
     }
 
     bool is_not_unique() const {
-      return counter_ > 1;
+      return is_external() || counter_.is_shared();
     }
   };
 
-  static storage* make_new_storage_with_fixed_capacity(size_t new_capacity) {
-    storage* ans =
-      new (static_cast<storage*>(operator new(sizeof(storage) + new_capacity * sizeof(T))))
-      storage(new_capacity);
-    return ans;
+  static constexpr size_t external_flag = ~(~size_t(0) >> 1);
+
+  struct external_prefix {
+    void (*release)(void* buffer, size_t bytes);
+  };
+
+  // the prefix padded so that the storage header after it stays aligned
+  static constexpr size_t external_prefix_bytes =
+      (sizeof(external_prefix) + alignof(storage) - 1) / alignof(storage) *
+      alignof(storage);
+
+  using storage_allocator =
+      typename alloc_traits::template rebind_alloc<storage>;
+  using storage_traits = std::allocator_traits<storage_allocator>;
+
+  // std::allocator is stateless, so its blocks can come straight from
+  // malloc, which knows the real size of what it handed out. Over-aligned
+  // blocks go through the allocator, which uses aligned operator new.
+  static constexpr bool uses_malloc =
+      std::is_same_v<Allocator, std::allocator<T>> &&
+      alignof(storage) <= alignof(std::max_align_t);
+
+  static size_t storage_bytes(size_t capacity) {
+    return sizeof(storage) + capacity * sizeof(T);
+  }
+
+  // blocks are counted in whole headers so that the allocator is asked for
+  // suitably aligned memory
+  static size_t storage_units(size_t capacity) {
+    return 1 + (capacity * sizeof(T) + sizeof(storage) - 1) / sizeof(storage);
+  }
+
+  // capacity a malloc block of the given size really has room for
+  static size_t usable_capacity(void* block, size_t bytes, size_t capacity) {
+    if constexpr (Growth::round_to_size_class) {
+      return (socow::detail::usable_size(block, bytes) - sizeof(storage)) /
+             sizeof(T);
+    }
+    return capacity;
+  }
+
+  // An allocator with an allocate_at_least() member (see
+  // socow::pool_allocator) says how much room its blocks really have, and
+  // the vector keeps all of it, whatever the growth policy.
+  static constexpr bool reports_block_size =
+      requires(storage_allocator& alloc, size_t n) {
+        alloc.allocate_at_least(n);
+      };
+
+  // capacity a block of the given number of whole headers has room for
+  static size_t units_capacity(size_t units) {
+    return (units - 1) * sizeof(storage) / sizeof(T);
+  }
+
+  // Whether a new buffer for size() elements would be no smaller than the
+  // current one. size_class_growth keeps all the room malloc rounds a block
+  // up to, a few bytes on the heap but up to a page for mmapped blocks, so
+  // the capacity may stay above size() after shrink_to_fit(). A block for
+  // size() elements is then asked of malloc and given straight back, which
+  // is much cheaper than moving the elements into it for nothing. The same
+  // goes for allocators that report their block sizes.
+  bool fits_tightly() const {
+    if (capacity() == size()) {
+      return true;
+    }
+    if constexpr (Growth::round_to_size_class && uses_malloc) {
+      size_t bytes = storage_bytes(size());
+      void* block = std::malloc(bytes);
+      if (block == nullptr) {
+        return false;
+      }
+      size_t fresh = usable_capacity(block, bytes, size());
+      std::free(block);
+      return fresh >= capacity();
+    } else if constexpr (!uses_malloc && reports_block_size) {
+      storage_allocator alloc(allocator());
+      auto [block, units] = alloc.allocate_at_least(storage_units(size()));
+      storage_traits::deallocate(alloc, block, units);
+      return units_capacity(units) >= capacity();
+    }
+    return false;
+  }
+
+  storage* make_new_storage_with_fixed_capacity(size_t new_capacity) {
+    if constexpr (uses_malloc) {
+      size_t bytes = storage_bytes(new_capacity);
+      void* block = std::malloc(bytes);
+      if (block == nullptr) {
+        throw std::bad_alloc();
+      }
+      Stats::record(socow::stat::allocations);
+      Stats::record(socow::stat::allocated_bytes, bytes);
+      return new (block)
+          storage(usable_capacity(block, bytes, new_capacity));
+    } else {
+      storage_allocator alloc(allocator());
+      size_t units = storage_units(new_capacity);
+      storage* ans;
+      if constexpr (reports_block_size) {
+        auto [block, count] = alloc.allocate_at_least(units);
+        ans = block;
+        units = count;
+        new_capacity = units_capacity(units);
+      } else {
+        ans = storage_traits::allocate(alloc, units);
+      }
+      Stats::record(socow::stat::allocations);
+      Stats::record(socow::stat::allocated_bytes, units * sizeof(storage));
+      return new (ans) storage(new_capacity);
+    }
   }
 
-  storage* copy_storage_with_fixed_capacity(size_t new_capacity) {
+  void free_storage(storage* block) {
+    if (block->is_external()) {
+      auto buffer =
+          reinterpret_cast<unsigned char*>(block) - external_prefix_bytes;
+      size_t bytes = buffer_offset() + block->capacity() * sizeof(T);
+      auto release = reinterpret_cast<external_prefix*>(buffer)->release;
+      block->~storage();
+      if (release != nullptr) {
+        release(buffer, bytes);
+      }
+      return;
+    }
+    Stats::record(socow::stat::frees);
+    if constexpr (uses_malloc) {
+      block->~storage();
+      std::free(block);
+    } else {
+      storage_allocator alloc(allocator());
+      size_t units = storage_units(block->capacity());
+      block->~storage();
+      storage_traits::deallocate(alloc, block, units);
+    }
+  }
+
+  // A unique malloc block of trivially copyable elements can be resized with
+  // realloc, which extends the block in place when there is room behind it
+  // and moves large (mmapped) blocks by remapping their pages.
+  static constexpr bool reallocatable =
+      uses_malloc && std::is_trivially_copyable_v<T>;
+
+  // only for a unique big storage of a reallocatable vector
+  void reallocate_storage(size_t new_capacity) {
+    size_t old_capacity = big_storage->capacity_;
+    size_t bytes = storage_bytes(new_capacity);
+    big_storage->~storage();
+    void* block = std::realloc(static_cast<void*>(big_storage), bytes);
+    if (block == nullptr) {
+      new (big_storage) storage(old_capacity);
+      throw std::bad_alloc();
+    }
+    Stats::record(socow::stat::reallocations);
+    Stats::record(socow::stat::allocated_bytes, bytes);
+    big_storage =
+        new (block) storage(usable_capacity(block, bytes, new_capacity));
+  }
+
+  storage* relocate_storage_with_fixed_capacity(size_t new_capacity) {
     storage* ans = make_new_storage_with_fixed_capacity(new_capacity);
     try {
-      copy_from_begin(my_begin(), ans->data_, size_);
+      transfer_from_begin(my_begin(), ans->data_, size(), !is_shared());
     } catch (...) {
-      operator delete(ans);
+      free_storage(ans);
       throw;
     }
     return ans;
   }
 
-  bool is_small;
-  size_t size_;
+  // the top bit of size_and_flag_ tells that the elements live in the big
+  // storage, the rest is the size; a separate bool would pad the object by
+  // another word
+  static constexpr size_t big_flag = ~(~size_t(0) >> 1);
+
+  bool is_small() const {
+    return (size_and_flag_ & big_flag) == 0;
+  }
+
+  void set_small(bool small) {
+    size_and_flag_ = small ? size() : size() | big_flag;
+  }
+
+  void set_size(size_t n) {
+    size_and_flag_ = (size_and_flag_ & big_flag) | n;
+  }
+
+  size_t size_and_flag_;
   union {
-    T small_storage[SMALL_SIZE];
+    // one slot even for SMALL_SIZE 0, since zero-size arrays are not
+    // standard C++; it shares its room with the pointer
+    alignas(Alignment) T small_storage[std::max<size_t>(SMALL_SIZE, 1)];
     storage* big_storage;
   };
 };
 
+// A window [offset, offset + size()) into the elements of a Vector
+// (a socow_vector). It holds a copy of the vector, so a big storage is
+// shared rather than copied and stays alive as long as any slice of it does.
+// The first write through a slice of a shared storage copies only the
+// window. Slices handed to other threads need a Vector with
+// socow::atomic_refcount.
+template <typename Vector>
+struct socow_slice {
+  using value_type = typename Vector::value_type;
+  using iterator = value_type*;
+  using const_iterator = value_type const*;
+
+  socow_slice() : offset_(0), size_(0) {}
+
+  socow_slice(Vector const& source, size_t offset, size_t count)
+      : source_(source), offset_(offset), size_(count) {}
+
+  size_t size() const {
+    return size_;
+  }
+
+  bool empty() const {
+    return size_ == 0;
+  }
+
+  const_iterator begin() const {
+    return source_.cbegin() + offset_;
+  }
+
+  const_iterator end() const {
+    return begin() + size_;
+  }
+
+  const_iterator cbegin() const {
+    return begin();
+  }
+
+  const_iterator cend() const {
+    return end();
+  }
+
+  iterator begin() {
+    detach();
+    return source_.begin() + offset_;
+  }
+
+  iterator end() {
+    return begin() + size_;
+  }
+
+  value_type const* data() const {
+    return begin();
+  }
+
+  value_type* data() {
+    return begin();
+  }
+
+  value_type const& operator[](size_t i) const {
+    return begin()[i];
+  }
+
+  value_type& operator[](size_t i) {
+    return begin()[i];
+  }
+
+#if defined(SOCOW_HAS_SPAN)
+  std::span<value_type const> view() const {
+    return {begin(), size_};
+  }
+#endif
+
+  // a narrower window into the same storage
+  socow_slice slice(size_t offset, size_t count) const {
+    return {source_, offset_ + offset, count};
+  }
+
+  // the elements of the window in a vector of their own
+  Vector to_vector() const {
+    Vector ans(source_.get_allocator());
+    ans.reserve(size_);
+    ans.insert(ans.cend(), begin(), end());
+    return ans;
+  }
+
+  // Copies the window out of a shared storage, leaving the rest of it to
+  // the other owners. A storage only this slice refers to is kept as is.
+  void detach() {
+    if (source_.is_shared()) {
+      source_ = to_vector();
+      offset_ = 0;
+    }
+  }
+
+private:
+  Vector source_;
+  size_t offset_;
+  size_t size_;
+};
+
+// An immutable snapshot of a Vector (a socow_vector), made by
+// Vector::freeze(). It only has const accessors, so copies of it in any
+// number of threads can share one storage through an atomic reference
+// count, while the mutable Vector keeps its own (possibly non-atomic) one.
+// Small vectors are copied inline.
+template <typename Vector>
+struct frozen_socow_vector {
+  using value_type = typename Vector::value_type;
+  using const_iterator = value_type const*;
+  using shared_type =
+      typename Vector::template with_refcount<socow::atomic_refcount>;
+
+  frozen_socow_vector() = default;
+
+  explicit frozen_socow_vector(shared_type elements)
+      : elements_(std::move(elements)) {}
+
+  size_t size() const {
+    return elements_.size();
+  }
+
+  bool empty() const {
+    return elements_.empty();
+  }
+
+  value_type const& operator[](size_t i) const {
+    return elements_[i];
+  }
+
+  value_type const* data() const {
+    return elements_.data();
+  }
+
+  value_type const& front() const {
+    return elements_.front();
+  }
+
+  value_type const& back() const {
+    return elements_.back();
+  }
+
+  const_iterator begin() const {
+    return elements_.begin();
+  }
+
+  const_iterator end() const {
+    return elements_.end();
+  }
+
+  const_iterator cbegin() const {
+    return begin();
+  }
+
+  const_iterator cend() const {
+    return end();
+  }
+
+#if defined(SOCOW_HAS_SPAN)
+  std::span<value_type const> view() const {
+    return elements_.view();
+  }
+#endif
+
+  // A mutable vector sharing the snapshot's storage; it copies the
+  // elements on its first write. It counts references atomically like
+  // the snapshot it shares with.
+  shared_type thaw() const {
+    return elements_;
+  }
+
+private:
+  shared_type elements_;
+};
+
+#if __has_include(<memory_resource>)
+namespace socow::pmr {
+
+template <typename T,
+          size_t SMALL_SIZE = small_size_for<T, 64, alignof(T), sizeof(void*)>,
+          typename RefCount = socow::nonatomic_refcount,
+          typename Growth = socow::growth_2x,
+          size_t Alignment = alignof(T),
+          typename Stats = socow::no_stats>
+using vector = socow_vector<T, SMALL_SIZE, RefCount,
+                            std::pmr::polymorphic_allocator<T>, Growth,
+                            Alignment, Stats>;
+
+} // namespace socow::pmr
+#endif
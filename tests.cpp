@@ -1,15 +1,72 @@
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <list>
+#include <memory>
+#include <memory_resource>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
 #include <unordered_set>
+#include <vector>
 
 #include "gtest/gtest.h"
 
+#include "socow-atomic-vector.h"
+#include "socow-chunked-vector.h"
+#include "socow-overlay-vector.h"
+#include "socow-pool-allocator.h"
 #include "socow-vector.h"
+#if __has_include(<execinfo.h>)
+#include "socow-detach-report.h"
+#endif
 
 template struct socow_vector<int, 2>;
-
-template <typename T>
-T const& as_const(T& obj) {
-    return obj;
-}
+template struct socow_vector<int, 2, socow::atomic_refcount>;
+template struct socow_vector<std::string, 2>;
+
+// one word of size (with the small/big flag in its top bit) plus the union
+static_assert(sizeof(socow_vector<int, 2>) == 2 * sizeof(void*));
+static_assert(sizeof(socow_vector<char, 8>) == 2 * sizeof(void*));
+static_assert(sizeof(socow_vector<int, 2, socow::atomic_refcount>) ==
+              2 * sizeof(void*));
+static_assert(sizeof(socow_vector<std::string, 1>) ==
+              sizeof(void*) + sizeof(std::string));
+static_assert(sizeof(socow_vector<socow_vector<int, 2>, 3>) ==
+              sizeof(void*) + 3 * sizeof(socow_vector<int, 2>));
+static_assert(sizeof(socow::pmr::vector<int, 2>) == 3 * sizeof(void*));
+
+// the default SMALL_SIZE: as many elements inline as fit in a cache line
+static_assert(socow::small_size_for<char> == 56);
+static_assert(socow::small_size_for<int> == 14);
+static_assert(socow::small_size_for<uint64_t> == 7);
+static_assert(socow::small_size_for<std::string> == 1);
+static_assert(socow::small_size_for<char[64]> == 1);
+static_assert(socow::small_size_for<char[4096]> == 1);
+static_assert(sizeof(socow_vector<char>) == 64);
+static_assert(sizeof(socow_vector<int>) == 64);
+static_assert(sizeof(socow_vector<uint64_t>) == 64);
+static_assert(sizeof(socow_vector<std::string>) == 40);
+static_assert(sizeof(socow_vector<char[64]>) == 72);
+static_assert(sizeof(socow_vector<char[4096]>) == 4104);
+static_assert(sizeof(socow::pmr::vector<int>) == 64);
+static_assert(sizeof(socow_vector<int, socow::small_size_for<int, 32>>) == 32);
+static_assert(sizeof(socow_vector<char, socow::small_size_for<char, 64, 32>,
+                                  socow::nonatomic_refcount,
+                                  std::allocator<char>, socow::growth_2x,
+                                  32>) == 64);
+
+// a function object rather than a function template, so that argument
+// dependent lookup does not pick std::as_const for containers of std types
+struct {
+    template <typename T>
+    T const& operator()(T& obj) const {
+        return obj;
+    }
+} const as_const;
 
 template <typename T>
 struct element {
@@ -125,8 +182,43 @@ size_t element<T>::throw_countdown = 0;
 template <typename T>
 size_t element<T>::copy_counter = 0;
 
+template struct socow_vector<element<size_t>, 2>;
+
 using container = socow_vector<element<size_t>, 2>;
 
+template <typename T>
+struct counting_allocator {
+    using value_type = T;
+
+    explicit counting_allocator(size_t* live) : live(live) {}
+
+    template <typename U>
+    counting_allocator(counting_allocator<U> const& other)
+        : live(other.live) {}
+
+    T* allocate(size_t n) {
+        ++*live;
+        return std::allocator<T>().allocate(n);
+    }
+
+    void deallocate(T* p, size_t n) {
+        --*live;
+        std::allocator<T>().deallocate(p, n);
+    }
+
+    friend bool operator==(counting_allocator const& a,
+                           counting_allocator const& b) {
+        return a.live == b.live;
+    }
+
+    friend bool operator!=(counting_allocator const& a,
+                           counting_allocator const& b) {
+        return a.live != b.live;
+    }
+
+    size_t* live;
+};
+
 TEST(correctness, default_ctor) {
     container a;
     element<size_t>::expect_no_instances();
@@ -561,6 +653,140 @@ TEST(correctness, insert_empty) {
     EXPECT_EQ(43, v[0]);
 }
 
+TEST(correctness, insert_middle) {
+    size_t const N = 500;
+    {
+        container a;
+        for (size_t i = 0; i != N; ++i)
+            a.insert(as_const(a).begin() + a.size() / 2, i);
+
+        EXPECT_EQ(N, a.size());
+        for (size_t i = 0; i != N / 2; ++i) {
+            EXPECT_EQ(2 * i + 1, a[i]);
+            EXPECT_EQ(N - 2 - 2 * i, a[N / 2 + i]);
+        }
+    }
+    element<size_t>::expect_no_instances();
+}
+
+TEST(correctness, insert_from_self) {
+    socow_vector<std::string, 2> a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(std::string(50, 'a' + i));
+    a.reserve(20);
+
+    a.insert(as_const(a).begin(), a[5]);
+    a.insert(as_const(a).begin(), 2, a[9]);
+    EXPECT_EQ(13, a.size());
+    EXPECT_EQ(std::string(50, 'a' + 8), a[0]);
+    EXPECT_EQ(std::string(50, 'a' + 8), a[1]);
+    EXPECT_EQ(std::string(50, 'a' + 5), a[2]);
+    EXPECT_EQ(std::string(50, 'a'), a[3]);
+}
+
+TEST(correctness, insert_count) {
+    {
+        container a;
+        for (size_t i = 0; i != 10; ++i)
+            a.push_back(i);
+
+        auto it = a.insert(as_const(a).begin() + 3, 100, 42);
+        EXPECT_TRUE(it == as_const(a).begin() + 3);
+        EXPECT_EQ(110, a.size());
+        for (size_t i = 0; i != 3; ++i)
+            EXPECT_EQ(i, a[i]);
+        for (size_t i = 3; i != 103; ++i)
+            EXPECT_EQ(42, a[i]);
+        for (size_t i = 103; i != 110; ++i)
+            EXPECT_EQ(i - 100, a[i]);
+    }
+    element<size_t>::expect_no_instances();
+}
+
+TEST(correctness, insert_range) {
+    std::vector<size_t> src = {10, 11, 12, 13};
+    {
+        container a;
+        a.push_back(1);
+        a.push_back(2);
+        a.insert(as_const(a).begin() + 1, src.begin(), src.end());
+        a.insert(as_const(a).end(), {20, 21});
+
+        std::list<size_t> lst = {30, 31, 32};
+        a.insert(as_const(a).begin(), lst.begin(), lst.end());
+
+        std::vector<size_t> expected = {30, 31, 32, 1, 10, 11, 12, 13, 2, 20, 21};
+        EXPECT_EQ(expected.size(), a.size());
+        for (size_t i = 0; i != expected.size(); ++i)
+            EXPECT_EQ(expected[i], a[i]);
+    }
+    element<size_t>::expect_no_instances();
+}
+
+TEST(correctness, insert_input_range) {
+    std::istringstream in("5 6 7");
+    socow_vector<size_t, 2> a;
+    a.push_back(1);
+    a.push_back(2);
+    a.insert(as_const(a).begin() + 1, std::istream_iterator<size_t>(in),
+             std::istream_iterator<size_t>());
+
+    std::vector<size_t> expected = {1, 5, 6, 7, 2};
+    EXPECT_EQ(expected.size(), a.size());
+    for (size_t i = 0; i != expected.size(); ++i)
+        EXPECT_EQ(expected[i], a[i]);
+}
+
+TEST(correctness, insert_range_reallocates_once) {
+    socow_vector<size_t, 2> a;
+    a.push_back(1);
+    std::vector<size_t> src(1000, 7);
+    a.insert(as_const(a).begin(), src.begin(), src.end());
+    EXPECT_EQ(1001, a.size());
+    EXPECT_EQ(1001, a.capacity());
+    EXPECT_EQ(1, a[1000]);
+}
+
+TEST(correctness, insert_count_throw) {
+    {
+        container a;
+        a.reserve(10);
+        for (size_t i = 0; i != 5; ++i)
+            a.push_back(i);
+
+        element<size_t>::set_throw_countdown(3);
+        EXPECT_THROW(a.insert(as_const(a).begin() + 2, 4, 42),
+                     std::runtime_error);
+        EXPECT_EQ(5, a.size());
+        for (size_t i = 0; i != 5; ++i)
+            EXPECT_EQ(i, a[i]);
+
+        element<size_t>::set_throw_countdown(3);
+        EXPECT_THROW(a.insert(as_const(a).begin() + 2, 40, 42),
+                     std::runtime_error);
+        EXPECT_EQ(5, a.size());
+        for (size_t i = 0; i != 5; ++i)
+            EXPECT_EQ(i, a[i]);
+    }
+    element<size_t>::expect_no_instances();
+}
+
+TEST(correctness, insert_shift_throw) {
+    {
+        container a;
+        a.reserve(10);
+        for (size_t i = 0; i != 5; ++i)
+            a.push_back(i);
+
+        // the new element is built, then moving it into place throws
+        element<size_t>::set_throw_countdown(2);
+        EXPECT_THROW(a.insert(as_const(a).begin() + 2, 42), std::runtime_error);
+        element<size_t>::set_throw_countdown(0);
+        EXPECT_EQ(5, a.size());
+    }
+    element<size_t>::expect_no_instances();
+}
+
 TEST(correctness, erase) {
     size_t const N = 500;
     {
@@ -770,153 +996,555 @@ TEST(correctness, iter_types) {
     EXPECT_TRUE(test2);
 }
 
-TEST(correctness_cow, copy_ctor) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, move_ctor) {
+    size_t const N = 500;
+    {
+        container a;
+        for (size_t i = 0; i != N; ++i)
+            a.push_back(i);
+        element<size_t> const* old_data = as_const(a).data();
 
-    container b = a;
-    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+        element<size_t>::set_copy_counter(0);
+        container b = std::move(a);
+        EXPECT_EQ(0, element<size_t>::get_copy_counter());
+        EXPECT_EQ(old_data, as_const(b).data());
+        EXPECT_TRUE(a.empty());
+        EXPECT_EQ(N, b.size());
+        for (size_t i = 0; i != N; ++i)
+            EXPECT_EQ(i, b[i]);
+
+        a.push_back(42);
+        EXPECT_EQ(42, a[0]);
+    }
+    element<size_t>::expect_no_instances();
 }
 
-TEST(correctness_cow, subscript) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, move_ctor_small) {
+    {
+        socow_vector<element<size_t>, 3> a;
+        a.push_back(1);
+        a.push_back(2);
 
-    container b = a;
-    b[3] = 42;
-    EXPECT_EQ(103, a[3]);
+        socow_vector<element<size_t>, 3> b = std::move(a);
+        EXPECT_TRUE(a.empty());
+        EXPECT_EQ(2, b.size());
+        EXPECT_EQ(1, b[0]);
+        EXPECT_EQ(2, b[1]);
+    }
+    element<size_t>::expect_no_instances();
 }
 
-TEST(correctness_cow, subscript_single_user) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, move_assignment) {
+    size_t const N = 500;
+    {
+        container a;
+        for (size_t i = 0; i != N; ++i)
+            a.push_back(2 * i + 1);
+        element<size_t> const* old_data = as_const(a).data();
 
-    element<size_t>::set_copy_counter(0);
-    a[3] = 42;
-    EXPECT_EQ(1, element<size_t>::get_copy_counter());
-}
+        container b;
+        b.push_back(42);
+        container c = b;
 
-TEST(correctness_cow, subscript_const) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+        b = std::move(a);
+        EXPECT_EQ(old_data, as_const(b).data());
+        EXPECT_TRUE(a.empty());
+        EXPECT_EQ(N, b.size());
+        for (size_t i = 0; i != N; ++i)
+            EXPECT_EQ(2 * i + 1, b[i]);
+        EXPECT_EQ(1, c.size());
+        EXPECT_EQ(42, c[0]);
 
-    container b = a;
-    as_const(b)[3];
-    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+        b = std::move(c);
+        EXPECT_EQ(1, b.size());
+        EXPECT_EQ(42, b[0]);
+    }
+    element<size_t>::expect_no_instances();
 }
 
-TEST(correctness_cow, data) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, emplace_back_move_only) {
+    size_t const N = 500;
+    socow_vector<std::unique_ptr<size_t>, 2> a;
+    for (size_t i = 0; i != N; ++i) {
+        if (i % 2 == 0)
+            a.push_back(std::make_unique<size_t>(i));
+        else
+            a.emplace_back(new size_t(i));
+    }
 
-    container b = a;
-    b.data()[3] = 42;
-    EXPECT_EQ(103, a[3]);
+    EXPECT_EQ(N, a.size());
+    for (size_t i = 0; i != N; ++i)
+        EXPECT_EQ(i, *a[i]);
 }
 
-TEST(correctness_cow, data_single_user) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, reallocation_moves_unique) {
+    size_t const N = 100;
+    socow_vector<socow_vector<size_t, 2>, 2> a;
+    std::vector<size_t const*> inner_data;
+    for (size_t i = 0; i != N; ++i) {
+        socow_vector<size_t, 2> inner;
+        for (size_t j = 0; j != 10; ++j)
+            inner.push_back(i + j);
+        inner_data.push_back(as_const(inner).data());
+        a.push_back(std::move(inner));
+    }
 
-    element<size_t>::set_copy_counter(0);
-    a.data()[3] = 42;
-    EXPECT_EQ(1, element<size_t>::get_copy_counter());
+    for (size_t i = 0; i != N; ++i)
+        EXPECT_EQ(inner_data[i], as_const(a)[i].data());
 }
 
-TEST(correctness_cow, data_const) {
-    container a;
+TEST(correctness, reallocation_copies_shared) {
+    socow_vector<std::string, 2> a;
     for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+        a.push_back(std::string(100, 'a' + i));
 
-    container b = a;
-    as_const(b).data()[3];
-    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+    socow_vector<std::string, 2> b = a;
+    for (size_t i = 4; i != 100; ++i)
+        b.emplace_back(100, 'a');
+
+    for (size_t i = 0; i != 4; ++i) {
+        EXPECT_EQ(std::string(100, 'a' + i), as_const(a)[i]);
+        EXPECT_EQ(as_const(a)[i], as_const(b)[i]);
+    }
 }
 
-TEST(correctness_cow, front) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, reallocation_in_place_push_back_self) {
+    socow_vector<size_t, 2> a;
+    for (size_t i = 0; i != 1000; ++i)
+        a.push_back(i);
 
-    container b = a;
-    b.front() = 42;
-    EXPECT_EQ(100, a.front());
+    for (size_t i = 0; i != 3000; ++i) {
+        a.push_back(as_const(a)[i]);
+        a.shrink_to_fit();
+    }
+
+    EXPECT_EQ(4000, a.size());
+    EXPECT_EQ(4000, a.capacity());
+    for (size_t i = 0; i != a.size(); ++i)
+        EXPECT_EQ(i % 1000, as_const(a)[i]);
 }
 
-TEST(correctness_cow, front_single_user) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, reallocation_in_place_keeps_shared) {
+    socow_vector<size_t, 2> a;
+    for (size_t i = 0; i != 100; ++i)
+        a.push_back(i);
+    a.shrink_to_fit();
 
-    element<size_t>::set_copy_counter(0);
-    a.front() = 42;
-    EXPECT_EQ(1, element<size_t>::get_copy_counter());
+    socow_vector<size_t, 2> b = a;
+    size_t const* a_data = as_const(a).data();
+    b.push_back(100);
+    b.reserve(1000);
+
+    EXPECT_EQ(a_data, as_const(a).data());
+    EXPECT_EQ(100, a.size());
+    EXPECT_EQ(101, b.size());
+    for (size_t i = 0; i != 100; ++i)
+        EXPECT_EQ(as_const(a)[i], as_const(b)[i]);
 }
 
-TEST(correctness_cow, front_const) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, insert_rvalue) {
+    socow_vector<std::string, 2> a;
+    a.push_back("a");
+    a.push_back("c");
 
-    container b = a;
-    as_const(b).front();
-    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+    std::string s(100, 'b');
+    a.insert(as_const(a).begin() + 1, std::move(s));
+
+    EXPECT_EQ(3, a.size());
+    EXPECT_EQ("a", a[0]);
+    EXPECT_EQ(std::string(100, 'b'), a[1]);
+    EXPECT_EQ("c", a[2]);
 }
 
-TEST(correctness_cow, back) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(correctness, trivial_insert_erase) {
+    size_t const N = 500;
+    socow_vector<size_t, 3> a;
+    for (size_t i = 0; i != N; ++i)
+        a.insert(a.begin() + a.size() / 2, i);
+
+    socow_vector<size_t, 3> b = a;
+    b.erase(b.begin() + 10, b.end() - 10);
+    EXPECT_EQ(N, a.size());
+    EXPECT_EQ(20, b.size());
+    for (size_t i = 0; i != 10; ++i) {
+        EXPECT_EQ(a[i], b[i]);
+        EXPECT_EQ(a[N - 10 + i], b[10 + i]);
+    }
 
-    container b = a;
-    b.back() = 42;
-    EXPECT_EQ(103, a.back());
+    a.insert(a.begin() + 1, a[0]);
+    EXPECT_EQ(a[0], a[1]);
 }
 
-TEST(correctness_cow, back_single_user) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(small_object, swap_two_small_trivial) {
+    socow_vector<size_t, 3> a;
+    a.push_back(1);
+    a.push_back(2);
 
-    element<size_t>::set_copy_counter(0);
-    a.back() = 42;
-    EXPECT_EQ(1, element<size_t>::get_copy_counter());
-}
+    socow_vector<size_t, 3> b;
+    b.push_back(3);
 
-TEST(correctness_cow, back_const) {
-    container a;
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+    a.swap(b);
 
-    container b = a;
-    as_const(b).back();
-    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+    EXPECT_EQ(1, a.size());
+    EXPECT_EQ(2, b.size());
+    EXPECT_EQ(1, b[0]);
+    EXPECT_EQ(2, b[1]);
+    EXPECT_EQ(3, a[0]);
 }
 
-TEST(correctness_cow, push_back) {
-    container a;
-    a.reserve(5);
-    for (size_t i = 0; i != 4; ++i)
-        a.push_back(i + 100);
+TEST(allocator, pmr_arena) {
+    alignas(std::max_align_t) unsigned char buffer[1 << 14];
+    std::pmr::monotonic_buffer_resource arena(
+        buffer, sizeof(buffer), std::pmr::null_memory_resource());
 
-    container b = a;
+    socow::pmr::vector<size_t, 2> a(&arena);
+    for (size_t i = 0; i != 500; ++i)
+        a.push_back(i);
+    EXPECT_EQ(&arena, a.get_allocator().resource());
 
-    a.push_back(1);
-    b.push_back(2);
+    socow::pmr::vector<size_t, 2> b(a, a.get_allocator());
+    EXPECT_EQ(as_const(a).data(), as_const(b).data());
 
-    EXPECT_EQ(1, a[4]);
-    EXPECT_EQ(2, b[4]);
+    b[0] = 42;
+    EXPECT_NE(as_const(a).data(), as_const(b).data());
+    EXPECT_EQ(0, a[0]);
+    EXPECT_EQ(42, b[0]);
 }
 
-TEST(correctness_cow, pop_back) {
-    container a;
-    a.reserve(5);
+TEST(allocator, pmr_copy_leaves_arena) {
+    std::pmr::monotonic_buffer_resource arena;
+    socow::pmr::vector<size_t, 2> a(&arena);
+    for (size_t i = 0; i != 500; ++i)
+        a.push_back(i);
+
+    socow::pmr::vector<size_t, 2> b = a;
+    EXPECT_EQ(std::pmr::get_default_resource(), b.get_allocator().resource());
+    EXPECT_NE(as_const(a).data(), as_const(b).data());
+
+    std::pmr::monotonic_buffer_resource other_arena;
+    socow::pmr::vector<size_t, 2> c(&other_arena);
+    c.push_back(1);
+    c = a;
+    EXPECT_EQ(&other_arena, c.get_allocator().resource());
+    EXPECT_NE(as_const(a).data(), as_const(c).data());
+    for (size_t i = 0; i != 500; ++i) {
+        EXPECT_EQ(i, b[i]);
+        EXPECT_EQ(i, c[i]);
+    }
+}
+
+TEST(allocator, stateful) {
+    using vec_t = socow_vector<element<size_t>, 2, socow::nonatomic_refcount,
+                               counting_allocator<element<size_t>>>;
+    size_t live_a = 0, live_b = 0;
+    {
+        vec_t a{counting_allocator<element<size_t>>(&live_a)};
+        for (size_t i = 0; i != 100; ++i)
+            a.push_back(i);
+        EXPECT_EQ(1, live_a);
+
+        vec_t b = a;
+        EXPECT_EQ(1, live_a);
+        EXPECT_EQ(as_const(a).data(), as_const(b).data());
+
+        vec_t c{counting_allocator<element<size_t>>(&live_b)};
+        c = a;
+        EXPECT_EQ(1, live_a);
+        EXPECT_EQ(1, live_b);
+
+        vec_t d{counting_allocator<element<size_t>>(&live_b)};
+        d = std::move(b);
+        EXPECT_EQ(2, live_b);
+        EXPECT_TRUE(d.get_allocator() == c.get_allocator());
+        for (size_t i = 0; i != 100; ++i) {
+            EXPECT_EQ(i, c[i]);
+            EXPECT_EQ(i, d[i]);
+        }
+    }
+    EXPECT_EQ(0, live_a);
+    EXPECT_EQ(0, live_b);
+    element<size_t>::expect_no_instances();
+}
+
+struct alignas(64) cache_line {
+    size_t value;
+};
+
+bool is_aligned(void const* ptr, size_t alignment) {
+    return reinterpret_cast<std::uintptr_t>(ptr) % alignment == 0;
+}
+
+TEST(alignment, over_aligned_element) {
+    socow_vector<cache_line, 2> a;
+    a.push_back({0});
+    EXPECT_TRUE(is_aligned(as_const(a).data(), 64));
+    for (size_t i = 1; i != 100; ++i) {
+        a.push_back({i});
+        EXPECT_TRUE(is_aligned(as_const(a).data(), 64));
+    }
+
+    socow_vector<cache_line, 2> b = a;
+    b[0].value = 42;
+    EXPECT_TRUE(is_aligned(as_const(b).data(), 64));
+    for (size_t i = 0; i != 100; ++i)
+        EXPECT_EQ(i, as_const(a)[i].value);
+}
+
+TEST(alignment, aligned_data) {
+    using vec_t = socow_vector<float, 3, socow::nonatomic_refcount,
+                               std::allocator<float>, socow::growth_2x, 32>;
+    vec_t a;
+    EXPECT_TRUE(is_aligned(as_const(a).data(), 32));
+    for (size_t i = 0; i != 3; ++i)
+        a.push_back(i);
+    EXPECT_TRUE(is_aligned(as_const(a).data(), 32));
+    for (size_t i = 3; i != 1000; ++i) {
+        a.push_back(i);
+        EXPECT_TRUE(is_aligned(as_const(a).data(), 32));
+    }
+    a.erase(as_const(a).begin() + 2, as_const(a).end());
+    a.shrink_to_fit();
+    EXPECT_TRUE(is_aligned(as_const(a).data(), 32));
+    EXPECT_EQ(1.0f, a[1]);
+}
+
+TEST(alignment, pmr_aligned_data) {
+    std::pmr::monotonic_buffer_resource arena;
+    socow::pmr::vector<double, 1, socow::nonatomic_refcount,
+                       socow::growth_2x, 64> a(&arena);
+    for (size_t i = 0; i != 100; ++i) {
+        a.push_back(i);
+        EXPECT_TRUE(is_aligned(as_const(a).data(), 64));
+    }
+}
+
+TEST(growth, zero_small_size) {
+    size_t const N = 500;
+    {
+        socow_vector<element<size_t>, 0> a;
+        EXPECT_EQ(0, a.capacity());
+        for (size_t i = 0; i != N; ++i)
+            a.push_back(i);
+        for (size_t i = 0; i != N; ++i)
+            EXPECT_EQ(i, a[i]);
+        a.clear();
+        a.shrink_to_fit();
+        EXPECT_EQ(0, a.capacity());
+    }
+    element<size_t>::expect_no_instances();
+}
+
+TEST(growth, one_and_half) {
+    socow_vector<size_t, 2, socow::nonatomic_refcount, std::allocator<size_t>,
+                 socow::growth_1_5x>
+        a;
+    std::vector<size_t> capacities;
+    for (size_t i = 0; i != 20; ++i) {
+        a.push_back(i);
+        if (capacities.empty() || capacities.back() != a.capacity())
+            capacities.push_back(a.capacity());
+    }
+    std::vector<size_t> expected = {2, 3, 4, 6, 9, 13, 19, 28};
+    EXPECT_EQ(expected, capacities);
+    for (size_t i = 0; i != 20; ++i)
+        EXPECT_EQ(i, a[i]);
+}
+
+TEST(growth, size_class) {
+    socow_vector<size_t, 2, socow::nonatomic_refcount, std::allocator<size_t>,
+                 socow::size_class_growth<>>
+        a;
+    for (size_t i = 0; i != 1000; ++i) {
+        a.push_back(i);
+        EXPECT_LE(a.size(), a.capacity());
+    }
+    a.reserve(1001);
+    EXPECT_LE(1001, a.capacity());
+    a.shrink_to_fit();
+    EXPECT_LE(1000, a.capacity());
+    for (size_t i = 0; i != 1000; ++i)
+        EXPECT_EQ(i, a[i]);
+}
+
+TEST(growth, size_class_shrink_twice) {
+    {
+        socow_vector<element<size_t>, 2, socow::nonatomic_refcount,
+                     std::allocator<element<size_t>>,
+                     socow::size_class_growth<>>
+            a;
+        for (size_t i = 0; i != 1000; ++i)
+            a.push_back(i);
+        a.shrink_to_fit();
+        element<size_t> const* data = as_const(a).data();
+        size_t capacity = a.capacity();
+        a.shrink_to_fit();
+        EXPECT_EQ(data, as_const(a).data());
+        EXPECT_EQ(capacity, a.capacity());
+    }
+    element<size_t>::expect_no_instances();
+}
+
+// above glibc's largest mmap threshold, where blocks are rounded up to pages
+TEST(growth, size_class_shrink_twice_mapped) {
+    socow_vector<std::string, 2, socow::nonatomic_refcount,
+                 std::allocator<std::string>, socow::size_class_growth<>>
+        a;
+    a.resize((size_t(1) << 20) + 1000);
+    a.shrink_to_fit();
+    std::string const* data = as_const(a).data();
+    size_t capacity = a.capacity();
+    a.shrink_to_fit();
+    EXPECT_EQ(data, as_const(a).data());
+    EXPECT_EQ(capacity, a.capacity());
+}
+
+TEST(correctness_cow, copy_ctor) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+}
+
+TEST(correctness_cow, subscript) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    b[3] = 42;
+    EXPECT_EQ(103, a[3]);
+}
+
+TEST(correctness_cow, subscript_single_user) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    element<size_t>::set_copy_counter(0);
+    a[3] = 42;
+    EXPECT_EQ(1, element<size_t>::get_copy_counter());
+}
+
+TEST(correctness_cow, subscript_const) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    as_const(b)[3];
+    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+}
+
+TEST(correctness_cow, data) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    b.data()[3] = 42;
+    EXPECT_EQ(103, a[3]);
+}
+
+TEST(correctness_cow, data_single_user) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    element<size_t>::set_copy_counter(0);
+    a.data()[3] = 42;
+    EXPECT_EQ(1, element<size_t>::get_copy_counter());
+}
+
+TEST(correctness_cow, data_const) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    as_const(b).data()[3];
+    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+}
+
+TEST(correctness_cow, front) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    b.front() = 42;
+    EXPECT_EQ(100, a.front());
+}
+
+TEST(correctness_cow, front_single_user) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    element<size_t>::set_copy_counter(0);
+    a.front() = 42;
+    EXPECT_EQ(1, element<size_t>::get_copy_counter());
+}
+
+TEST(correctness_cow, front_const) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    as_const(b).front();
+    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+}
+
+TEST(correctness_cow, back) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    b.back() = 42;
+    EXPECT_EQ(103, a.back());
+}
+
+TEST(correctness_cow, back_single_user) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    element<size_t>::set_copy_counter(0);
+    a.back() = 42;
+    EXPECT_EQ(1, element<size_t>::get_copy_counter());
+}
+
+TEST(correctness_cow, back_const) {
+    container a;
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    as_const(b).back();
+    EXPECT_EQ(as_const(a).data(), as_const(b).data());
+}
+
+TEST(correctness_cow, push_back) {
+    container a;
+    a.reserve(5);
+    for (size_t i = 0; i != 4; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+
+    a.push_back(1);
+    b.push_back(2);
+
+    EXPECT_EQ(1, a[4]);
+    EXPECT_EQ(2, b[4]);
+}
+
+TEST(correctness_cow, pop_back) {
+    container a;
+    a.reserve(5);
     for (size_t i = 0; i != 4; ++i)
         a.push_back(i + 100);
 
@@ -1103,6 +1731,318 @@ TEST(correctness_cow, erase_single_user) {
     EXPECT_EQ(old_data, reinterpret_cast<uintptr_t>(as_const(a).data()));
 }
 
+TEST(correctness_cow, pop_back_copies_survivors) {
+    container a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    element<size_t>::set_copy_counter(0);
+    a.pop_back();
+    EXPECT_EQ(9, element<size_t>::get_copy_counter());
+    EXPECT_EQ(9, a.size());
+    EXPECT_EQ(10, b.size());
+    EXPECT_EQ(108, a.back());
+}
+
+TEST(correctness_cow, erase_copies_survivors) {
+    container a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    element<size_t>::set_copy_counter(0);
+    auto it = a.erase(as_const(a).begin() + 2, as_const(a).begin() + 8);
+    EXPECT_EQ(4, element<size_t>::get_copy_counter());
+    EXPECT_TRUE(it == as_const(a).begin() + 2);
+    EXPECT_EQ(4, a.size());
+    EXPECT_EQ(101, a[1]);
+    EXPECT_EQ(108, a[2]);
+    EXPECT_EQ(10, b.size());
+}
+
+TEST(correctness_cow, insert_copies_once) {
+    container a;
+    a.reserve(20);
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    element<size_t>::set_copy_counter(0);
+    a.insert(as_const(a).begin() + 5, 3, 42);
+    EXPECT_EQ(13, element<size_t>::get_copy_counter());
+    EXPECT_EQ(13, a.size());
+    EXPECT_EQ(42, a[5]);
+    EXPECT_EQ(105, a[8]);
+    EXPECT_EQ(10, b.size());
+}
+
+TEST(correctness_cow, push_back_copies_once) {
+    container a;
+    a.reserve(20);
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    element<size_t>::set_copy_counter(0);
+    a.push_back(42);
+    EXPECT_EQ(11, element<size_t>::get_copy_counter());
+    EXPECT_EQ(42, a[10]);
+    EXPECT_EQ(10, b.size());
+}
+
+TEST(correctness_cow, clear_copies_nothing) {
+    container a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    element<size_t>::set_copy_counter(0);
+    a.clear();
+    EXPECT_EQ(0, element<size_t>::get_copy_counter());
+    EXPECT_TRUE(a.empty());
+    EXPECT_EQ(10, b.size());
+}
+
+TEST(correctness_cow, read_accessors_do_not_detach) {
+    container a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    element<size_t>::set_copy_counter(0);
+    EXPECT_EQ(a.cdata(), b.cdata());
+    EXPECT_EQ(a.cbegin(), b.cbegin());
+    EXPECT_EQ(10, b.cend() - b.cbegin());
+    EXPECT_EQ(100, b.cfront());
+    EXPECT_EQ(109, b.cback());
+    EXPECT_EQ(0, element<size_t>::get_copy_counter());
+    EXPECT_EQ(a.cdata(), b.cdata());
+}
+
+TEST(correctness_cow, detach_copies_once) {
+    container a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    element<size_t>::set_copy_counter(0);
+    b.detach();
+    EXPECT_EQ(10, element<size_t>::get_copy_counter());
+    EXPECT_NE(a.cdata(), b.cdata());
+
+    element<size_t>::set_copy_counter(0);
+    element<size_t> const* data = b.cdata();
+    b.detach();
+    EXPECT_EQ(data, &b[0]);
+    EXPECT_EQ(0, element<size_t>::get_copy_counter());
+    EXPECT_EQ(100, a.cfront());
+}
+
+#if defined(SOCOW_HAS_SPAN)
+TEST(correctness_cow, spans) {
+    container a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i + 100);
+
+    container b = a;
+    std::span<element<size_t> const> view = b.view();
+    EXPECT_EQ(a.cdata(), view.data());
+    EXPECT_EQ(10, view.size());
+
+    element<size_t>::set_copy_counter(0);
+    std::span<element<size_t>> span = b.mutable_span();
+    EXPECT_EQ(10, element<size_t>::get_copy_counter());
+    EXPECT_EQ(b.cdata(), span.data());
+    for (auto& e : span)
+        e = 1;
+    EXPECT_EQ(1, b.cback());
+    EXPECT_EQ(109, a.cback());
+}
+#endif
+
+TEST(slice, shares_storage) {
+    container a;
+    for (size_t i = 0; i != 100; ++i)
+        a.push_back(i);
+
+    element<size_t>::set_copy_counter(0);
+    auto s = a.slice(10, 50);
+    auto t = s.slice(5, 10);
+    EXPECT_EQ(0, element<size_t>::get_copy_counter());
+    EXPECT_EQ(50, s.size());
+    EXPECT_EQ(a.cdata() + 10, s.cbegin());
+    EXPECT_EQ(a.cdata() + 15, t.cbegin());
+    EXPECT_EQ(15, as_const(t)[0]);
+    EXPECT_EQ(24, *(t.cend() - 1));
+}
+
+TEST(slice, detach_copies_window) {
+    container a;
+    for (size_t i = 0; i != 100; ++i)
+        a.push_back(i);
+
+    auto s = a.slice(10, 20);
+    element<size_t>::set_copy_counter(0);
+    s[0] = 1000;
+    EXPECT_EQ(21, element<size_t>::get_copy_counter());
+    EXPECT_EQ(1000, as_const(s)[0]);
+    EXPECT_EQ(11, as_const(s)[1]);
+    EXPECT_EQ(10, as_const(a)[10]);
+    EXPECT_NE(a.cdata() + 10, s.cbegin());
+}
+
+TEST(slice, outlives_source) {
+    socow_vector<std::string, 2> s_copy;
+    socow_slice<socow_vector<std::string, 2>> s;
+    {
+        socow_vector<std::string, 2> a;
+        for (size_t i = 0; i != 10; ++i)
+            a.push_back(std::string(50, 'a' + i));
+        s = a.slice(3, 4);
+    }
+    std::string const* data = s.cbegin();
+    s[0] = "x";
+    EXPECT_EQ(data, s.cbegin());
+    EXPECT_EQ("x", as_const(s)[0]);
+    EXPECT_EQ(std::string(50, 'e'), as_const(s)[1]);
+
+    s_copy = s.to_vector();
+    EXPECT_EQ(4, s_copy.size());
+    EXPECT_EQ(std::string(50, 'g'), s_copy.cback());
+}
+
+TEST(slice, small_source) {
+    socow_vector<size_t, 4> a;
+    for (size_t i = 0; i != 3; ++i)
+        a.push_back(i);
+    auto s = a.slice(1, 2);
+    s[0] = 42;
+    EXPECT_EQ(1, as_const(a)[1]);
+    EXPECT_EQ(42, as_const(s)[0]);
+    EXPECT_EQ(2, as_const(s)[1]);
+}
+
+TEST(chunked, push_back_and_index) {
+    size_t const N = 1000;
+    socow_chunked_vector<size_t, 2, 64> a;
+    EXPECT_TRUE(a.empty());
+    a.push_back(0);
+    EXPECT_EQ(1, a.chunk_count());
+    for (size_t i = 1; i != N; ++i)
+        a.push_back(i);
+
+    EXPECT_EQ(N, a.size());
+    EXPECT_EQ((N + 63) / 64, a.chunk_count());
+    for (size_t i = 0; i != N; ++i)
+        EXPECT_EQ(i, as_const(a)[i]);
+    size_t i = 0;
+    for (size_t x : a)
+        EXPECT_EQ(i++, x);
+    EXPECT_EQ(N, a.end() - a.begin());
+
+    while (a.size() > 64)
+        a.pop_back();
+    EXPECT_EQ(1, a.chunk_count());
+    EXPECT_EQ(63, a.back());
+}
+
+TEST(chunked, write_copies_one_chunk) {
+    size_t const N = 1000;
+    socow_chunked_vector<element<size_t>, 2, 64> a;
+    for (size_t i = 0; i != N; ++i)
+        a.push_back(i);
+
+    auto b = a;
+    element<size_t>::set_copy_counter(0);
+    EXPECT_EQ(500, b[500]);
+    EXPECT_EQ(64, element<size_t>::get_copy_counter());
+
+    b[500] = 42;
+    b[510] = 43;
+    EXPECT_EQ(500, as_const(a)[500]);
+    EXPECT_EQ(42, as_const(b)[500]);
+    EXPECT_EQ(43, as_const(b)[510]);
+    EXPECT_EQ(&as_const(a)[0], &as_const(b)[0]);
+    EXPECT_NE(&as_const(a)[500], &as_const(b)[500]);
+}
+
+TEST(chunked, push_back_from_self) {
+    socow_chunked_vector<std::string, 1, 4> a;
+    a.push_back(std::string(100, 'a'));
+    for (size_t i = 0; i != 20; ++i)
+        a.push_back(as_const(a)[i]);
+    auto b = a;
+    b.push_back(as_const(b)[0]);
+
+    EXPECT_EQ(21, a.size());
+    EXPECT_EQ(22, b.size());
+    for (std::string const& s : b)
+        EXPECT_EQ(std::string(100, 'a'), s);
+}
+
+TEST(overlay, writes_into_shared_storage_are_patches) {
+    size_t const N = 1000;
+    socow_vector<element<size_t>, 2> base;
+    for (size_t i = 0; i != N; ++i)
+        base.push_back(i);
+
+    socow_overlay_vector<element<size_t>, 2> a(base);
+    a.set_max_overlay_fraction(0.1);
+    element<size_t>::set_copy_counter(0);
+    a.set(500, 1);
+    a.set(10, 2);
+    a.set(500, 3);
+    EXPECT_EQ(2, a.overlay_size());
+    EXPECT_EQ(3, a[500]);
+    EXPECT_EQ(2, a[10]);
+    EXPECT_EQ(11, a[11]);
+    EXPECT_EQ(500, as_const(base)[500]);
+    EXPECT_GT(N, element<size_t>::get_copy_counter());
+
+    base = socow_vector<element<size_t>, 2>();
+    a.set(20, 4);
+    EXPECT_EQ(0, a.overlay_size());
+    EXPECT_EQ(3, a[500]);
+    EXPECT_EQ(4, a[20]);
+}
+
+TEST(overlay, compacts_past_fraction) {
+    size_t const N = 1000;
+    socow_vector<size_t, 2> base;
+    for (size_t i = 0; i != N; ++i)
+        base.push_back(i);
+
+    socow_overlay_vector<size_t, 2> a(base);
+    a.set_max_overlay_fraction(0.01);
+    for (size_t i = 0; i != 10; ++i)
+        a.set(i * 10, 0);
+    EXPECT_EQ(10, a.overlay_size());
+    a.set(1, 0);
+    EXPECT_EQ(0, a.overlay_size());
+    EXPECT_NE(as_const(base).data(), a.base().cdata());
+    for (size_t i = 0; i != N; ++i)
+        EXPECT_EQ((i < 100 && i % 10 == 0) || i == 1 ? 0 : i, a[i]);
+    EXPECT_EQ(10, as_const(base)[10]);
+}
+
+TEST(overlay, size_changes_compact) {
+    socow_vector<std::string, 1> base;
+    for (size_t i = 0; i != 10; ++i)
+        base.push_back(std::string(50, 'a' + i));
+
+    socow_overlay_vector<std::string, 1> a(base);
+    a.set_max_overlay_fraction(1);
+    a.set(0, "x");
+    a.push_back(a[0]);
+    EXPECT_EQ(0, a.overlay_size());
+    EXPECT_EQ(11, a.size());
+    EXPECT_EQ("x", a.back());
+    a.pop_back();
+    EXPECT_EQ(std::string(50, 'j'), a.back());
+    EXPECT_EQ(std::string(50, 'a'), as_const(base)[0]);
+}
+
 TEST(small_object, shrink_to_fit) {
     socow_vector<element<size_t>, 3> a;
     a.reserve(5);
@@ -1314,3 +2254,884 @@ TEST(small_object, erase_big_into_small_3) {
     EXPECT_THROW(a.erase(as_const(a).begin() + 2, as_const(a).end() - 1),
                  std::runtime_error);
 }
+
+TEST(concurrency, atomic_refcount_shared_copies) {
+    using vec_t = socow_vector<std::string, 2, socow::atomic_refcount>;
+    size_t const N = 1000, THREADS = 4, ITERATIONS = 200;
+
+    vec_t origin;
+    for (size_t i = 0; i != N; ++i)
+        origin.push_back(std::to_string(i));
+
+    std::vector<std::thread> threads;
+    std::vector<size_t> failures(THREADS);
+    for (size_t t = 0; t != THREADS; ++t) {
+        vec_t copy = origin;
+        threads.emplace_back([copy, &failures, t]() mutable {
+            for (size_t it = 0; it != ITERATIONS; ++it) {
+                vec_t local = copy;
+                vec_t const& reader = local;
+                if (reader[it % N] != std::to_string(it % N))
+                    ++failures[t];
+
+                vec_t writer = copy;
+                writer[it % N] = "changed";
+                writer.push_back("tail");
+                if (as_const(copy)[it % N] != std::to_string(it % N))
+                    ++failures[t];
+            }
+            copy[0] = "thread";
+        });
+    }
+    for (std::thread& thread : threads)
+        thread.join();
+
+    for (size_t t = 0; t != THREADS; ++t)
+        EXPECT_EQ(0, failures[t]);
+    for (size_t i = 0; i != N; ++i)
+        EXPECT_EQ(std::to_string(i), as_const(origin)[i]);
+}
+
+TEST(concurrency, atomic_refcount_last_owner_mutates) {
+    using vec_t = socow_vector<size_t, 2, socow::atomic_refcount>;
+    size_t const N = 10000, THREADS = 4;
+
+    for (size_t round = 0; round != 20; ++round) {
+        vec_t origin;
+        for (size_t i = 0; i != N; ++i)
+            origin.push_back(i);
+
+        std::vector<std::thread> threads;
+        std::vector<size_t> sums(THREADS);
+        for (size_t t = 0; t != THREADS; ++t) {
+            threads.emplace_back([copy = origin, &sums, t]() mutable {
+                for (size_t i = 0; i != N; ++i)
+                    sums[t] += as_const(copy)[i];
+                for (size_t i = 0; i != N; ++i)
+                    copy[i] = 0;
+            });
+        }
+        for (size_t i = 0; i != N; ++i)
+            origin[i] = 1;
+        for (std::thread& thread : threads)
+            thread.join();
+
+        for (size_t t = 0; t != THREADS; ++t)
+            EXPECT_EQ(N * (N - 1) / 2, sums[t]);
+        for (size_t i = 0; i != N; ++i)
+            EXPECT_EQ(1, as_const(origin)[i]);
+    }
+}
+
+template <typename T, size_t SMALL_SIZE>
+using counted_vector = socow_vector<T, SMALL_SIZE, socow::nonatomic_refcount,
+                                    std::allocator<T>, socow::growth_2x,
+                                    alignof(T), socow::thread_stats>;
+
+TEST(stats, allocations_and_detaches) {
+    socow::thread_stats::reset();
+    {
+        counted_vector<std::string, 2> a;
+        a.push_back("a");
+        a.push_back("b");
+        EXPECT_EQ(0, socow::thread_stats::snapshot()[socow::stat::allocations]);
+
+        a.push_back("c");
+        a.push_back("d");
+        auto after_growth = socow::thread_stats::snapshot();
+        EXPECT_EQ(1, after_growth[socow::stat::allocations]);
+        EXPECT_EQ(0, after_growth[socow::stat::frees]);
+        EXPECT_EQ(1, after_growth[socow::stat::small_to_big]);
+        EXPECT_EQ(0, after_growth[socow::stat::elements_copied]);
+
+        counted_vector<std::string, 2> b = a;
+        EXPECT_EQ(0, socow::thread_stats::snapshot()[socow::stat::detaches]);
+        b[0] = "x";
+        auto after_detach = socow::thread_stats::snapshot();
+        EXPECT_EQ(1, after_detach[socow::stat::detaches]);
+        EXPECT_EQ(4, after_detach[socow::stat::elements_copied]);
+        EXPECT_EQ(2, after_detach[socow::stat::allocations]);
+
+        b.erase(as_const(b).begin() + 1, as_const(b).end());
+        b.shrink_to_fit();
+        EXPECT_EQ(1, socow::thread_stats::snapshot()[socow::stat::big_to_small]);
+    }
+    auto total = socow::thread_stats::snapshot();
+    EXPECT_EQ(total[socow::stat::allocations], total[socow::stat::frees]);
+}
+
+TEST(stats, swap_kinds) {
+    counted_vector<int, 2> small_a, small_b, big_a, big_b;
+    for (int i = 0; i != 10; ++i) {
+        big_a.push_back(i);
+        big_b.push_back(i);
+    }
+    socow::thread_stats::reset();
+    small_a.swap(small_b);
+    big_a.swap(small_a);
+    small_b.swap(small_a);
+    small_b.swap(big_b);
+
+    auto snapshot = socow::thread_stats::snapshot();
+    EXPECT_EQ(1, snapshot[socow::stat::small_small_swaps]);
+    EXPECT_EQ(2, snapshot[socow::stat::small_big_swaps]);
+    EXPECT_EQ(1, snapshot[socow::stat::big_big_swaps]);
+    EXPECT_EQ(0, snapshot[socow::stat::elements_copied]);
+}
+
+TEST(stats, global_counters) {
+    using vec_t = socow_vector<int, 2, socow::atomic_refcount, std::allocator<int>,
+                               socow::growth_2x, alignof(int), socow::global_stats>;
+    size_t const THREADS = 4;
+    socow::global_stats::reset();
+    vec_t origin;
+    for (int i = 0; i != 100; ++i)
+        origin.push_back(i);
+    size_t const base = socow::global_stats::snapshot()[socow::stat::detaches];
+
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t != THREADS; ++t) {
+        threads.emplace_back([&origin] {
+            vec_t copy = origin;
+            copy[0] = 1;
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    auto snapshot = socow::global_stats::snapshot();
+    EXPECT_EQ(base + THREADS, snapshot[socow::stat::detaches]);
+    EXPECT_STREQ("detaches", socow::stat_name(socow::stat::detaches));
+}
+
+#if __has_include(<execinfo.h>)
+TEST(stats, detach_report) {
+    using vec_t = socow_vector<size_t, 2, socow::nonatomic_refcount,
+                               std::allocator<size_t>, socow::growth_2x,
+                               alignof(size_t), socow::detach_report>;
+    size_t const N = 100;
+    socow::detach_report::reset();
+    vec_t a;
+    for (size_t i = 0; i != N; ++i)
+        a.push_back(i);
+
+    vec_t b = a;
+    b.front() = 1;
+    // not a constant, so the loop body stays a single call site
+    size_t volatile rounds = 3;
+    for (size_t i = 0; i != rounds; ++i) {
+        vec_t c = a;
+        c[0] = 1;
+    }
+    vec_t d = a;
+    d.pop_back();
+
+    auto sites = socow::detach_report::sites();
+    ASSERT_EQ(3, sites.size());
+    EXPECT_EQ(3, sites[0].detaches);
+    EXPECT_EQ(3 * N * sizeof(size_t), sites[0].bytes);
+    EXPECT_EQ(N * sizeof(size_t), sites[1].bytes);
+    EXPECT_EQ((N - 1) * sizeof(size_t), sites[2].bytes);
+    EXPECT_FALSE(sites[0].frames.empty());
+    socow::detach_report::reset();
+}
+#endif
+
+TEST(frozen, freeze_keeps_unique_storage) {
+    socow_vector<std::string, 2> a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(std::string(50, 'a' + i));
+    std::string const* data = as_const(a).data();
+
+    auto frozen = std::move(a).freeze();
+    EXPECT_TRUE(a.empty());
+    EXPECT_EQ(data, frozen.data());
+    EXPECT_EQ(10, frozen.size());
+    EXPECT_EQ(std::string(50, 'j'), frozen.back());
+}
+
+TEST(frozen, freeze_copies_shared_storage) {
+    container a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i);
+    container b = a;
+
+    element<size_t>::set_copy_counter(0);
+    auto frozen = b.freeze();
+    EXPECT_EQ(10, element<size_t>::get_copy_counter());
+    EXPECT_NE(a.cdata(), frozen.data());
+    EXPECT_EQ(a.cdata(), b.cdata());
+
+    socow_vector<element<size_t>, 3> small;
+    small.push_back(5);
+    auto frozen_small = small.freeze();
+    EXPECT_EQ(1, frozen_small.size());
+    EXPECT_EQ(5, frozen_small.front());
+    EXPECT_EQ(5, small.cfront());
+}
+
+TEST(frozen, thaw_detaches_lazily) {
+    socow_vector<size_t, 2> a;
+    for (size_t i = 0; i != 100; ++i)
+        a.push_back(i);
+    auto const frozen = std::move(a).freeze();
+
+    auto thawed = frozen.thaw();
+    EXPECT_EQ(frozen.data(), as_const(thawed).data());
+    thawed[0] = 42;
+    EXPECT_NE(frozen.data(), as_const(thawed).data());
+    EXPECT_EQ(0, frozen[0]);
+    EXPECT_EQ(42, as_const(thawed)[0]);
+}
+
+TEST(frozen, shared_between_threads) {
+    size_t const THREADS = 4;
+    size_t const N = 1000;
+    socow_vector<size_t, 2> a;
+    for (size_t i = 0; i != N; ++i)
+        a.push_back(i);
+    auto const frozen = std::move(a).freeze();
+
+    std::vector<size_t> sums(THREADS);
+    std::vector<std::thread> threads;
+    for (size_t t = 0; t != THREADS; ++t) {
+        threads.emplace_back([&frozen, &sums, t] {
+            for (size_t round = 0; round != 100; ++round) {
+                auto copy = frozen;
+                auto thawed = copy.thaw();
+                if (round == 0) {
+                    for (size_t x : copy)
+                        sums[t] += x;
+                }
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+    for (size_t t = 0; t != THREADS; ++t)
+        EXPECT_EQ(N * (N - 1) / 2, sums[t]);
+}
+
+TEST(atomic_vector, load_shares_published_storage) {
+    socow_vector<size_t, 2, socow::atomic_refcount> a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i);
+    size_t const* elements = a.cdata();
+    atomic_socow_vector<size_t, 2> published(std::move(a));
+
+    auto b = published.load();
+    auto c = published.load();
+    EXPECT_EQ(elements, b.cdata());
+    EXPECT_EQ(elements, c.cdata());
+    EXPECT_TRUE(b.is_shared());
+    EXPECT_EQ(10, c.size());
+    EXPECT_EQ(9, c.back());
+}
+
+TEST(atomic_vector, small_vectors_are_shared) {
+    atomic_socow_vector<size_t, 4> published;
+    socow_vector<size_t, 4, socow::atomic_refcount> a;
+    a.push_back(42);
+    published.store(a);
+
+    auto b = published.load();
+    auto c = published.load();
+    EXPECT_EQ(b.cdata(), c.cdata());
+    ASSERT_EQ(1, b.size());
+    EXPECT_EQ(42, b[0]);
+
+    b[0] = 43;
+    EXPECT_EQ(42, published.load()[0]);
+}
+
+TEST(atomic_vector, compare_exchange) {
+    atomic_socow_vector<size_t, 2> published;
+    auto expected = published.load();
+    auto stale = expected;
+
+    socow_vector<size_t, 2, socow::atomic_refcount> next = expected;
+    next.push_back(1);
+    EXPECT_TRUE(published.compare_exchange_strong(expected, next));
+    EXPECT_EQ(1, published.load().size());
+
+    next.push_back(2);
+    EXPECT_FALSE(published.compare_exchange_strong(stale, next));
+    EXPECT_EQ(1, published.load().size());
+    EXPECT_EQ(published.load().cdata(), stale.cdata());
+
+    EXPECT_TRUE(published.compare_exchange_weak(stale, next));
+    EXPECT_EQ(2, published.load().size());
+}
+
+TEST(atomic_vector, readers_see_whole_snapshots) {
+    size_t const READERS = 4;
+    size_t const UPDATES = 200;
+    atomic_socow_vector<size_t, 2> published;
+    std::atomic<bool> done(false);
+
+    std::vector<std::thread> readers;
+    std::vector<size_t> bad(READERS);
+    for (size_t t = 0; t != READERS; ++t) {
+        readers.emplace_back([&, t] {
+            while (!done.load()) {
+                auto snapshot = published.load();
+                for (size_t x : snapshot) {
+                    if (x != snapshot.size())
+                        ++bad[t];
+                }
+            }
+        });
+    }
+    std::thread writer([&] {
+        for (size_t i = 1; i != UPDATES; ++i) {
+            auto expected = published.load();
+            socow_vector<size_t, 2, socow::atomic_refcount> next;
+            do {
+                next = expected;
+                for (size_t& x : next)
+                    x++;
+                next.push_back(next.size() + 1);
+            } while (!published.compare_exchange_weak(expected, next));
+        }
+        done = true;
+    });
+    writer.join();
+    for (auto& thread : readers)
+        thread.join();
+
+    for (size_t t = 0; t != READERS; ++t)
+        EXPECT_EQ(0, bad[t]);
+    EXPECT_EQ(UPDATES - 1, published.load().size());
+}
+
+#if defined(SOCOW_HAS_POSIX)
+std::filesystem::path write_temp_file(std::string const& name,
+                                      std::vector<uint64_t> const& elements) {
+    std::filesystem::path path =
+        std::filesystem::temp_directory_path() / ("socow-" + name);
+    std::ofstream out(path, std::ios::binary | std::ios::trunc);
+    out.write(reinterpret_cast<char const*>(elements.data()),
+              elements.size() * sizeof(uint64_t));
+    return path;
+}
+
+TEST(mapped, map_file_shares_mapping) {
+    std::vector<uint64_t> elements(10000);
+    for (size_t i = 0; i != elements.size(); ++i)
+        elements[i] = i * i;
+    auto path = write_temp_file("shares", elements);
+
+    auto a = socow_vector<uint64_t, 4>::map_file(path.c_str());
+    ASSERT_EQ(elements.size(), a.size());
+    EXPECT_TRUE(std::equal(a.cbegin(), a.cend(), elements.begin()));
+    EXPECT_EQ(a.size(), a.capacity());
+    EXPECT_TRUE(a.is_shared());
+
+    socow_vector<uint64_t, 4> b = a;
+    EXPECT_EQ(a.cdata(), b.cdata());
+    std::filesystem::remove(path);
+}
+
+TEST(mapped, mutation_detaches_into_heap) {
+    auto path = write_temp_file("detach", {1, 2, 3, 4, 5, 6, 7, 8});
+    auto a = socow_vector<uint64_t, 2>::map_file(path.c_str());
+    auto b = a;
+    uint64_t const* mapped = a.cdata();
+
+    a[0] = 10;
+    EXPECT_NE(mapped, a.cdata());
+    EXPECT_FALSE(a.is_shared());
+    EXPECT_EQ(10, a[0]);
+    EXPECT_EQ(1, b.cfront());
+    EXPECT_EQ(mapped, b.cdata());
+
+    b.push_back(9);
+    EXPECT_EQ(9, b.size());
+    EXPECT_EQ(1, b[0]);
+
+    auto c = socow_vector<uint64_t, 2>::map_file(path.c_str());
+    c.pop_back();
+    c.shrink_to_fit();
+    EXPECT_EQ(7, c.size());
+    EXPECT_EQ(7, c.back());
+
+    auto d = socow_vector<uint64_t, 2>::map_file(path.c_str());
+    d.clear();
+    EXPECT_TRUE(d.empty());
+    std::filesystem::remove(path);
+}
+
+template <size_t Alignment>
+void check_over_aligned_mapping(std::filesystem::path const& path,
+                                size_t count) {
+    using vector = socow_vector<uint64_t, 2, socow::nonatomic_refcount,
+                                std::allocator<uint64_t>, socow::growth_2x,
+                                Alignment>;
+    static_assert(vector::buffer_offset() >= Alignment);
+    auto a = vector::map_file(path.c_str());
+    ASSERT_EQ(count, a.size());
+    EXPECT_EQ(0, reinterpret_cast<uintptr_t>(a.cdata()) % Alignment);
+    EXPECT_EQ(count - 1, a.cback());
+    auto b = a;
+    b[0] = 42;
+    EXPECT_EQ(0, a[0]);
+}
+
+TEST(mapped, header_bigger_than_a_page) {
+    std::vector<uint64_t> elements(3000);
+    for (size_t i = 0; i != elements.size(); ++i)
+        elements[i] = i;
+    auto path = write_temp_file("aligned", elements);
+    check_over_aligned_mapping<4096>(path, elements.size());
+    check_over_aligned_mapping<16384>(path, elements.size());
+    std::filesystem::remove(path);
+}
+
+TEST(mapped, map_file_errors) {
+    using vector = socow_vector<uint64_t, 2>;
+    auto path = write_temp_file("empty", {});
+    auto a = vector::map_file(path.c_str());
+    EXPECT_TRUE(a.empty());
+    std::filesystem::remove(path);
+
+    EXPECT_THROW(vector::map_file(path.c_str()), std::system_error);
+}
+#endif
+
+template <typename Vector>
+bool same_elements(Vector const& a, Vector const& b) {
+    return std::equal(a.cbegin(), a.cend(), b.cbegin(), b.cend());
+}
+
+TEST(serialization, stream_round_trip) {
+    socow_vector<uint32_t, 3> small;
+    small.push_back(1);
+    small.push_back(2);
+    socow_vector<uint32_t, 3> big;
+    for (uint32_t i = 0; i != 1000; ++i)
+        big.push_back(i * 7);
+
+    std::stringstream stream;
+    small.write_to(stream);
+    big.write_to(stream);
+    EXPECT_EQ(2 * sizeof(socow::binary_header) + 1002 * sizeof(uint32_t),
+              stream.str().size());
+
+    auto a = socow_vector<uint32_t, 3>::read_from(stream);
+    auto b = socow_vector<uint32_t, 3>::read_from(stream);
+    EXPECT_TRUE(same_elements(small, a));
+    EXPECT_TRUE(same_elements(big, b));
+}
+
+TEST(serialization, rejects_foreign_input) {
+    using vector = socow_vector<uint32_t, 3>;
+    vector a;
+    for (uint32_t i = 0; i != 4; ++i)
+        a.push_back(i);
+    std::stringstream stream;
+    a.write_to(stream);
+    std::string bytes = stream.str();
+
+    std::stringstream wrong_size(bytes);
+    using wide_vector = socow_vector<uint64_t, 3>;
+    EXPECT_THROW(wide_vector::read_from(wrong_size), std::runtime_error);
+
+    std::stringstream truncated(bytes.substr(0, bytes.size() - 1));
+    EXPECT_THROW(vector::read_from(truncated), std::runtime_error);
+
+    std::string garbage = bytes;
+    garbage[0] = 'X';
+    std::stringstream not_a_vector(garbage);
+    EXPECT_THROW(vector::read_from(not_a_vector), std::runtime_error);
+
+    std::string other_version = bytes;
+    other_version[offsetof(socow::binary_header, version)] ^= 0x7f;
+    std::stringstream newer(other_version);
+    EXPECT_THROW(vector::read_from(newer), std::runtime_error);
+}
+
+#if defined(SOCOW_HAS_POSIX)
+TEST(serialization, fd_round_trip) {
+    using vector = socow_vector<uint64_t, 2>;
+    vector a;
+    for (uint64_t i = 0; i != 5000; ++i)
+        a.push_back(i ^ 0x5555);
+    auto path = write_temp_file("fd", {});
+    {
+        socow::detail::file_descriptor file{
+            ::open(path.c_str(), O_WRONLY | O_TRUNC)};
+        a.write_to(file.fd);
+    }
+    socow::detail::file_descriptor file{::open(path.c_str(), O_RDONLY)};
+    auto b = vector::read_from(file.fd);
+    EXPECT_TRUE(same_elements(a, b));
+    EXPECT_THROW(vector::read_from(file.fd), std::runtime_error);
+    std::filesystem::remove(path);
+}
+#endif
+
+size_t released_buffers = 0;
+
+void release_buffer(void* buffer, size_t) {
+    ++released_buffers;
+    std::free(buffer);
+}
+
+template <typename Vector>
+void check_from_buffer() {
+    size_t const n = 100;
+    void* buffer = std::aligned_alloc(
+        Vector::buffer_alignment(),
+        Vector::buffer_offset() + 128 * sizeof(uint64_t));
+    auto elements = reinterpret_cast<uint64_t*>(
+        static_cast<unsigned char*>(buffer) + Vector::buffer_offset());
+    for (size_t i = 0; i != n; ++i)
+        elements[i] = i;
+
+    released_buffers = 0;
+    {
+        Vector a = Vector::from_buffer(buffer, n, release_buffer);
+        EXPECT_EQ(elements, a.cdata());
+        EXPECT_EQ(n, a.size());
+        EXPECT_TRUE(a.is_shared());
+
+        Vector b = a;
+        b.push_back(n);
+        EXPECT_NE(elements, b.cdata());
+        EXPECT_EQ(n, b.back());
+        EXPECT_EQ(elements, a.cdata());
+    }
+    EXPECT_EQ(1, released_buffers);
+}
+
+TEST(serialization, from_buffer_adopts_without_copying) {
+    check_from_buffer<socow_vector<uint64_t, 2>>();
+    check_from_buffer<socow_vector<uint64_t, 2, socow::nonatomic_refcount,
+                                   std::allocator<uint64_t>, socow::growth_2x,
+                                   64>>();
+}
+
+TEST(serialization, from_buffer_without_release) {
+    std::vector<uint64_t> buffer(
+        (socow_vector<uint64_t, 2>::buffer_offset() + 3 * sizeof(uint64_t)) /
+        sizeof(uint64_t));
+    auto elements = buffer.data() +
+                    socow_vector<uint64_t, 2>::buffer_offset() / sizeof(uint64_t);
+    elements[0] = 4;
+    elements[1] = 5;
+    elements[2] = 6;
+    auto a = socow_vector<uint64_t, 2>::from_buffer(buffer.data(), 3);
+    a[1] = 50;
+    EXPECT_EQ(50, a[1]);
+    EXPECT_EQ(5, elements[1]);
+}
+
+// copyable from several threads at once, unlike element<T>
+struct parallel_element {
+    parallel_element(size_t val) : val(val) {
+        ++live;
+    }
+
+    parallel_element(parallel_element const& rhs) : val(rhs.val) {
+        if (throw_at.fetch_sub(1) == 1)
+            throw std::runtime_error("copy failed");
+        copied_by.add(std::this_thread::get_id());
+        ++live;
+    }
+
+    ~parallel_element() {
+        --live;
+    }
+
+    struct thread_set {
+        void add(std::thread::id id) {
+            std::lock_guard<std::mutex> lock(mutex);
+            ids.insert(id);
+        }
+
+        std::mutex mutex;
+        std::unordered_set<std::thread::id> ids;
+    };
+
+    size_t val;
+
+    static inline std::atomic<size_t> live = 0;
+    static inline std::atomic<size_t> throw_at = 0;
+    static inline thread_set copied_by;
+};
+
+template <>
+struct socow::parallel_copy<parallel_element>
+    : socow::parallel_copy_above<256, 4> {};
+
+TEST(parallel_copy, detach_splits_across_threads) {
+    {
+        socow_vector<parallel_element, 2> a;
+        for (size_t i = 0; i != 1000; ++i)
+            a.emplace_back(i);
+        auto b = a;
+        parallel_element::copied_by.ids.clear();
+        b.detach();
+        EXPECT_EQ(4, parallel_element::copied_by.ids.size());
+        for (size_t i = 0; i != 1000; ++i)
+            EXPECT_EQ(i, b.cdata()[i].val);
+        EXPECT_EQ(2000, parallel_element::live);
+
+        auto small = a.slice(0, 100).to_vector();
+        parallel_element::copied_by.ids.clear();
+        auto c = small;
+        c.detach();
+        EXPECT_EQ(1, parallel_element::copied_by.ids.size());
+    }
+    EXPECT_EQ(0, parallel_element::live);
+}
+
+TEST(parallel_copy, throwing_shard_keeps_source) {
+    {
+        socow_vector<parallel_element, 2> a;
+        for (size_t i = 0; i != 1000; ++i)
+            a.emplace_back(i);
+        auto b = a;
+        parallel_element::throw_at = 700;
+        EXPECT_THROW(b.detach(), std::runtime_error);
+        parallel_element::throw_at = 0;
+        EXPECT_EQ(1000, parallel_element::live);
+        EXPECT_TRUE(b.is_shared());
+        EXPECT_EQ(a.cdata(), b.cdata());
+    }
+    EXPECT_EQ(0, parallel_element::live);
+}
+
+TEST(pool, freed_blocks_are_reused) {
+    socow::block_pool::trim();
+    socow::block_pool::reset_stats();
+    uint64_t const* first;
+    size_t capacity;
+    {
+        socow::pooled_vector<uint64_t, 2> a;
+        for (uint64_t i = 0; i != 100; ++i)
+            a.push_back(i);
+        first = a.cdata();
+        capacity = a.capacity();
+    }
+    EXPECT_NE(0, socow::block_pool::cached_bytes());
+    {
+        socow::pooled_vector<uint64_t, 2> b;
+        b.reserve(capacity);
+        EXPECT_EQ(first, b.cdata());
+    }
+    auto stats = socow::block_pool::stats();
+    EXPECT_EQ(1, stats.hits);
+
+    socow::block_pool::trim();
+    EXPECT_EQ(0, socow::block_pool::cached_bytes());
+}
+
+TEST(pool, detach_and_shrink) {
+    socow::block_pool::trim();
+    socow::pooled_vector<std::string, 2> a;
+    for (size_t i = 0; i != 50; ++i)
+        a.push_back(std::to_string(i));
+    auto b = a;
+    b[0] = "x";
+    EXPECT_EQ("0", a[0]);
+    EXPECT_EQ("x", b[0]);
+    while (b.size() != 1)
+        b.pop_back();
+    b.shrink_to_fit();
+    EXPECT_EQ(1, b.size());
+    EXPECT_EQ("x", b[0]);
+}
+
+TEST(pool, vectors_keep_the_whole_block) {
+    socow::block_pool::trim();
+    {
+        // 16 bytes of header and 1024 of elements take a 2048-byte block
+        socow::pooled_vector<uint64_t, 2> a;
+        a.reserve(128);
+        EXPECT_EQ((2048 - 16) / 8, a.capacity());
+        a.resize(200);
+        uint64_t const* data = a.cdata();
+        a.shrink_to_fit();
+        EXPECT_EQ(data, a.cdata());
+        EXPECT_EQ((2048 - 16) / 8, a.capacity());
+    }
+    socow::block_pool::trim();
+
+    // blocks that are never cached are not rounded up either
+    size_t big = socow::block_pool::max_pooled_bytes + 1;
+    EXPECT_EQ(big, socow::block_pool::block_bytes(big, 8));
+    EXPECT_EQ(size_t(1) << 16, socow::block_pool::block_bytes(40000, 8));
+}
+
+TEST(pool, caps) {
+    socow::block_pool::trim();
+    size_t old_max = socow::block_pool::max_blocks_per_class();
+    socow::block_pool::set_max_blocks_per_class(1);
+    {
+        socow::pooled_vector<uint64_t, 2> a, b;
+        a.reserve(100);
+        b.reserve(100);
+    }
+    EXPECT_EQ(1024, socow::block_pool::cached_bytes());
+    socow::block_pool::set_max_blocks_per_class(0);
+    EXPECT_EQ(0, socow::block_pool::cached_bytes());
+    socow::block_pool::set_max_blocks_per_class(old_max);
+
+    size_t old_bytes = socow::block_pool::max_block_bytes();
+    socow::block_pool::set_max_block_bytes(256);
+    {
+        socow::pooled_vector<uint64_t, 2> a;
+        a.reserve(100);
+    }
+    EXPECT_EQ(0, socow::block_pool::cached_bytes());
+    socow::block_pool::set_max_block_bytes(old_bytes);
+}
+
+TEST(pool, zero_bytes) {
+    socow::block_pool::trim();
+    socow::pool_allocator<uint64_t> alloc;
+    uint64_t* p = alloc.allocate(0);
+    ASSERT_NE(nullptr, p);
+    alloc.deallocate(p, 0);
+    EXPECT_EQ(16, socow::block_pool::cached_bytes());
+    EXPECT_EQ(p, alloc.allocate(0));
+    alloc.deallocate(p, 0);
+    socow::block_pool::trim();
+}
+
+TEST(pool, blocks_of_exited_threads) {
+    socow::pooled_vector<uint64_t, 2> a;
+    std::thread([&a] {
+        socow::pooled_vector<uint64_t, 2> b;
+        for (uint64_t i = 0; i != 100; ++i)
+            b.push_back(i);
+        a = b;
+        socow::pooled_vector<uint64_t, 2> c;
+        c.reserve(1000);
+    }).join();
+    EXPECT_EQ(99, a.back());
+    a.clear();
+}
+
+TEST(resize, grows_and_shrinks) {
+    socow_vector<element<size_t>, 3> a;
+    a.resize(2, 1);
+    EXPECT_EQ(2, a.size());
+    EXPECT_EQ(1, a[1]);
+    a.resize(10, 7);
+    EXPECT_EQ(10, a.size());
+    EXPECT_EQ(1, a[1]);
+    EXPECT_EQ(7, a[9]);
+    a.resize(4);
+    EXPECT_EQ(4, a.size());
+    EXPECT_EQ(7, a[3]);
+    a.resize(0);
+    EXPECT_TRUE(a.empty());
+
+    socow_vector<size_t, 3> b;
+    b.push_back(1);
+    b.resize(2);
+    EXPECT_EQ(0, b[1]);
+    b.resize(10);
+    EXPECT_EQ(0, b[9]);
+}
+
+TEST(resize, value_from_the_vector) {
+    socow_vector<uint64_t, 2> a;
+    a.push_back(5);
+    a.push_back(6);
+    a.push_back(7);
+    a.shrink_to_fit();
+    a.resize(100, a[1]);
+    EXPECT_EQ(6, a[99]);
+
+    socow_vector<std::string, 2> b;
+    b.push_back("x");
+    b.push_back("y");
+    b.resize(50, b[0]);
+    EXPECT_EQ("x", b[49]);
+    b.assign(60, b[1]);
+    EXPECT_EQ(60, b.size());
+    EXPECT_EQ("y", b[0]);
+    EXPECT_EQ("y", b[59]);
+    b.assign(3, b[59]);
+    EXPECT_EQ(3, b.size());
+    EXPECT_EQ("y", b[2]);
+}
+
+TEST(resize, unshares_once) {
+    using vector = counted_vector<uint64_t, 2>;
+    vector a;
+    for (uint64_t i = 0; i != 100; ++i)
+        a.push_back(i);
+
+    vector b = a;
+    socow::thread_stats::reset();
+    b.resize(1000);
+    auto stats = socow::thread_stats::snapshot();
+    EXPECT_EQ(1, stats[socow::stat::allocations]);
+    EXPECT_EQ(100, stats[socow::stat::elements_copied]);
+    EXPECT_EQ(99, b[99]);
+    EXPECT_EQ(0, b[999]);
+
+    vector c = a;
+    socow::thread_stats::reset();
+    c.resize(10);
+    stats = socow::thread_stats::snapshot();
+    EXPECT_EQ(1, stats[socow::stat::allocations]);
+    EXPECT_EQ(10, stats[socow::stat::elements_copied]);
+
+    vector d = a;
+    socow::thread_stats::reset();
+    d.assign(500, 3);
+    stats = socow::thread_stats::snapshot();
+    EXPECT_EQ(1, stats[socow::stat::allocations]);
+    EXPECT_EQ(0, stats[socow::stat::elements_copied]);
+    EXPECT_EQ(3, d[499]);
+    EXPECT_EQ(99, a[99]);
+}
+
+TEST(resize, for_overwrite) {
+    socow_vector<char, 8> a;
+    a.resize_for_overwrite(1 << 20);
+    EXPECT_EQ(1 << 20, a.size());
+    std::memset(a.data(), 'z', a.size());
+    EXPECT_EQ('z', a[12345]);
+
+    socow_vector<std::string, 1> b;
+    b.resize_default_init(5);
+    EXPECT_EQ("", b[4]);
+}
+
+TEST(resize, strong_guarantee) {
+    socow_vector<element<size_t>, 3> a;
+    for (size_t i = 0; i != 10; ++i)
+        a.push_back(i);
+    auto b = a;
+    element<size_t>::set_throw_countdown(5);
+    EXPECT_THROW(b.resize(20, 42), std::runtime_error);
+    element<size_t>::set_throw_countdown(0);
+    EXPECT_EQ(10, b.size());
+    EXPECT_EQ(9, b[9]);
+
+    socow_vector<element<size_t>, 3> c;
+    c.reserve(40);
+    c.push_back(1);
+    element<size_t>::set_throw_countdown(3);
+    EXPECT_THROW(c.resize(20, 42), std::runtime_error);
+    element<size_t>::set_throw_countdown(0);
+    EXPECT_EQ(1, c.size());
+}
+
+TEST(auto_small, fills_the_inline_storage) {
+    socow_vector<int> a;
+    for (int i = 0; i != 14; ++i)
+        a.push_back(i);
+    EXPECT_EQ(14, a.capacity());
+    socow_vector<int> b = a;
+    EXPECT_NE(a.cdata(), b.cdata());
+    a.push_back(14);
+    EXPECT_LT(14, a.capacity());
+    EXPECT_EQ(14, b.capacity());
+}